@@ -0,0 +1,204 @@
+// Description: Microbenchmark of the compiled topic matcher against the
+// original topics_are_matching, which tokenized both topics for every call
+//
+// Usage: ./match_bench [iterations]
+#include "../headers.h"
+#include "../topic_match.h"
+
+#include <chrono>
+
+// The original implementation, kept verbatim as the reference
+bool legacy_topics_are_matching(const char *topic1, const char *topic2)
+{
+  // If the topics are the same, return true
+  if (strcmp(topic1, topic2) == 0)
+    return true;
+
+  // Create two copies of the topics
+  char *topic1_copy = strdup(topic1);
+  char *topic2_copy = strdup(topic2);
+
+  // If the topics are different, take tokens from them
+  vector<string> tokens1;
+  vector<string> tokens2;
+
+  // Tokenize the first topic
+  char *token = strtok(topic1_copy, "/");
+  while (token != NULL)
+  {
+    tokens1.push_back(token);
+    token = strtok(NULL, "/");
+  }
+
+  // Tokenize the second topic
+  token = strtok(topic2_copy, "/");
+  while (token != NULL)
+  {
+    tokens2.push_back(token);
+    token = strtok(NULL, "/");
+  }
+
+  // Check if the tokens are matching
+  int index_tokens1 = 0, index_tokens2 = 0;
+  while (index_tokens1 < tokens1.size() && index_tokens2 < tokens2.size())
+  {
+    // If the tokens are matching or the token in first vector is "+", continue
+    if (tokens1[index_tokens1] == tokens2[index_tokens2] || tokens1[index_tokens1] == "+")
+    {
+      index_tokens1++;
+      index_tokens2++;
+    }
+    else if (tokens1[index_tokens1] == "*")
+    {
+      // If the "*" token is the last token in the first vector, return true
+      if (index_tokens1 == tokens1.size() - 1)
+        return true;
+
+      // Get the next token after the "*" token
+      string next = tokens1[index_tokens1 + 1];
+
+      // Check if the next token after "*" is "+"
+      if (next == "+")
+      {
+        // If the next token is "+"
+
+        // If the next token is the last token in the first vector, return true
+        if (index_tokens1 == tokens1.size() - 2)
+          return true;
+
+        // Get the next token after the next token after "*"
+        next = tokens1[index_tokens1 + 2];
+
+        // Find the next token in the second vector that is equal to the next token after "*"
+        while (index_tokens2 < tokens2.size() && tokens2[index_tokens2] != next)
+          index_tokens2++;
+
+        // If the token is not found, return false
+        if (index_tokens2 == tokens2.size())
+          return false;
+
+        // Else, continue
+        index_tokens1 += 2;
+      }
+      else
+      {
+        // The next token is not "+"
+
+        // Find the next token in the second vector that is equal to the next token after "*"
+        while (index_tokens2 < tokens2.size() && tokens2[index_tokens2] != next)
+          index_tokens2++;
+
+        // If the token is not found, return false
+        if (index_tokens2 == tokens2.size())
+          return false;
+
+        // Else, continue
+        index_tokens1++;
+      }
+    }
+    // Else the topics are not matching
+    else
+    {
+      return false;
+    }
+  }
+
+  // If the tokens are matching, return true
+  if (index_tokens1 == tokens1.size() && index_tokens2 == tokens2.size())
+    return true;
+
+  // Otherwise, there is only a partial match between the topics
+  return false;
+}
+
+// The patterns and topics used by the wildcard tests of test.py
+static const char *test_patterns[] = {
+    "+/ec/100/pressure", "upb/+/100/pressure", "upb/ec/100/+",
+    "*/pressure", "upb/precis/elevator/*/floor", "upb/precis/*", "*",
+    "upb/+/100/+", "upb/+/100/*", "*/100/+", "*/100/*",
+    "upb/precis/100/+", "upb/precis/100/*", "upb/ec/100/pressure",
+    "*/+/floor", "*/+", "upb/*/*/people", "a_non_negative_int",
+};
+
+static const char *test_topics[] = {
+    "upb/precis/elevator/1/people", "upb/precis/elevator/1/floor",
+    "upb/precis/elevator/2/people", "upb/precis/elevator/2/floor",
+    "upb/precis/100/temperature", "upb/precis/100/humidity",
+    "upb/ec/100/temperature", "upb/ec/100/humidity", "upb/ec/100/pressure",
+    "upb/precis/100/pressure", "upb/precis/100/schedule/monday/8",
+    "upb/ec/100/schedule/tuesday/12", "a_non_negative_int",
+    "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwx",
+};
+
+#define PATTERN_COUNT (sizeof(test_patterns) / sizeof(test_patterns[0]))
+#define TOPIC_COUNT (sizeof(test_topics) / sizeof(test_topics[0]))
+
+static double elapsed_ns(chrono::steady_clock::time_point start)
+{
+  return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+  long iterations = argc > 1 ? atol(argv[1]) : 20000;
+
+  // Compile the patterns once, as the server does on SUBSCRIBE
+  vector<struct topic_pattern> patterns(PATTERN_COUNT);
+  for (size_t p = 0; p < PATTERN_COUNT; p++)
+    topic_pattern_compile(&patterns[p], test_patterns[p], MAX_TOPIC_LEN);
+
+  // Both matchers have to give the same answer for every pair
+  int mismatches = 0, matches = 0;
+  for (size_t t = 0; t < TOPIC_COUNT; t++)
+  {
+    struct topic_tokens tokens;
+    topic_tokenize(&tokens, test_topics[t], MAX_TOPIC_LEN);
+
+    for (size_t p = 0; p < PATTERN_COUNT; p++)
+    {
+      bool expected = legacy_topics_are_matching(test_patterns[p], test_topics[t]);
+      bool actual = topic_pattern_match(&patterns[p], &tokens);
+      matches += expected;
+
+      if (expected != actual)
+      {
+        fprintf(stderr, "Mismatch: %s on %s\n", test_patterns[p], test_topics[t]);
+        mismatches++;
+      }
+    }
+  }
+
+  if (mismatches != 0)
+    return 1;
+
+  long pairs = iterations * PATTERN_COUNT * TOPIC_COUNT;
+  volatile int sink = 0;
+
+  // The original function on every (pattern, topic) pair
+  auto start = chrono::steady_clock::now();
+  for (long i = 0; i < iterations; i++)
+    for (size_t t = 0; t < TOPIC_COUNT; t++)
+      for (size_t p = 0; p < PATTERN_COUNT; p++)
+        sink += legacy_topics_are_matching(test_patterns[p], test_topics[t]);
+  double legacy_ns = elapsed_ns(start);
+
+  // The topic is tokenized once per datagram, the patterns are precompiled
+  start = chrono::steady_clock::now();
+  for (long i = 0; i < iterations; i++)
+    for (size_t t = 0; t < TOPIC_COUNT; t++)
+    {
+      struct topic_tokens tokens;
+      topic_tokenize(&tokens, test_topics[t], MAX_TOPIC_LEN);
+
+      for (size_t p = 0; p < PATTERN_COUNT; p++)
+        sink += topic_pattern_match(&patterns[p], &tokens);
+    }
+  double compiled_ns = elapsed_ns(start);
+
+  printf("pairs per run: %zu (%d matching)\n", PATTERN_COUNT * TOPIC_COUNT, matches);
+  printf("legacy   topics_are_matching: %8.1f ns/match\n", legacy_ns / pairs);
+  printf("compiled topic_pattern_match: %8.1f ns/match\n", compiled_ns / pairs);
+  printf("speedup: %.1fx\n", legacy_ns / compiled_ns);
+
+  return 0;
+}
@@ -0,0 +1,209 @@
+// Description: Microbenchmark of the payload decoder against the original
+// get_*_value functions and printf formatting of the subscriber
+//
+// Usage: ./payload_bench [iterations]
+#include "../headers.h"
+#include "../payload.h"
+
+#include <chrono>
+
+// The original implementation, kept verbatim as the reference
+int get_INT_value(const char *content)
+{
+  // Get the sign of the integer
+  int8_t sign = content[0];
+
+  // Get the integer value
+  uint32_t value = 0;
+  memcpy(&value, content + sizeof(int8_t), sizeof(uint32_t));
+  value = ntohl(value);
+
+  // Return the integer value based on the sign
+  return sign == 0 ? value : -value;
+}
+
+float get_SHORT_REAL_value(const char *content)
+{
+  // Get the short real value
+  uint16_t value = 0;
+  memcpy(&value, content, sizeof(uint16_t));
+  value = ntohs(value);
+
+  // Return the float value
+  return (float)value / 100;
+}
+
+float get_FLOAT_value(const char *content)
+{
+  // Get the sign of the float
+  int8_t sign = content[0];
+
+  // Get the float value
+  uint32_t value = 0;
+  memcpy(&value, content + sizeof(int8_t), sizeof(uint32_t));
+  value = ntohl(value);
+
+  // Get the power of 10
+  int8_t power = content[sizeof(int8_t) + sizeof(uint32_t)];
+
+  // Return the float value based on the sign and power
+  return sign == 0 ? (float)value / pow(10, power) : -(float)value / pow(10, power);
+}
+
+// parse_response, writing to a buffer instead of stdout
+int legacy_format(char *out, const char *topic, size_t topic_len, uint8_t data_type, const char *content, size_t content_len)
+{
+  int len = topic_len;
+  switch (data_type)
+  {
+  case TYPE_INT:
+    return sprintf(out, "%.*s - INT - %d\n", len, topic, get_INT_value(content));
+  case TYPE_SHORT_REAL:
+    return sprintf(out, "%.*s - SHORT_REAL - %.2f\n", len, topic, get_SHORT_REAL_value(content));
+  case TYPE_FLOAT:
+    return sprintf(out, "%.*s - FLOAT - %.4f\n", len, topic, get_FLOAT_value(content));
+  case TYPE_STRING:
+    return sprintf(out, "%.*s - STRING - %.*s\n", len, topic, (int)strnlen(content, content_len), content);
+  default:
+    return 0;
+  }
+}
+
+// The contents of the messages checked by test.py
+struct sample
+{
+  const char *topic;
+  uint8_t data_type;
+  uint8_t sign;
+  uint32_t value;
+  uint8_t power;
+  const char *text;
+};
+
+static const struct sample samples[] = {
+    {"a_non_negative_int", TYPE_INT, 0, 10, 0, NULL},
+    {"a_negative_int", TYPE_INT, 1, 10, 0, NULL},
+    {"a_larger_value", TYPE_INT, 0, 1234567890, 0, NULL},
+    {"a_large_negative_value", TYPE_INT, 1, 1234567890, 0, NULL},
+    {"abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwx", TYPE_INT, 0, 10, 0, NULL},
+    {"that_is_small_short_real", TYPE_SHORT_REAL, 0, 230, 0, NULL},
+    {"that_is_big_short_real", TYPE_SHORT_REAL, 0, 65505, 0, NULL},
+    {"that_is_integer_short_real", TYPE_SHORT_REAL, 0, 1700, 0, NULL},
+    {"upb/precis/100/temperature", TYPE_SHORT_REAL, 0, 2430, 0, NULL},
+    {"upb/precis/100/humidity", TYPE_SHORT_REAL, 0, 2987, 0, NULL},
+    {"upb/ec/100/temperature", TYPE_SHORT_REAL, 0, 2130, 0, NULL},
+    {"upb/ec/100/humidity", TYPE_SHORT_REAL, 0, 2611, 0, NULL},
+    {"float_seventeen", TYPE_FLOAT, 0, 17, 0, NULL},
+    {"float_minus_seventeen", TYPE_FLOAT, 1, 17, 0, NULL},
+    {"a_strange_float", TYPE_FLOAT, 0, 12344321, 4, NULL},
+    {"a_negative_strange_float", TYPE_FLOAT, 1, 12344321, 4, NULL},
+    {"a_subunitary_float", TYPE_FLOAT, 0, 42, 3, NULL},
+    {"a_negative_subunitary_float", TYPE_FLOAT, 1, 42, 3, NULL},
+    {"upb/ec/100/pressure", TYPE_FLOAT, 0, 10132512, 4, NULL},
+    {"upb/precis/100/pressure", TYPE_FLOAT, 0, 10431249, 4, NULL},
+    {"ana_string_announce", TYPE_STRING, 0, 0, 0, "Ana are mere"},
+    {"huge_string", TYPE_STRING, 0, 0, 0, "abcdefghijklmnopqrstuvwxyz"},
+};
+
+#define SAMPLE_COUNT (sizeof(samples) / sizeof(samples[0]))
+
+// Encodes a sample as a UDP client would
+static void encode(const struct sample *s, struct udp_message *message)
+{
+  memset(message, 0, sizeof(struct udp_message));
+  strncpy(message->topic, s->topic, MAX_TOPIC_LEN);
+  message->data_type = s->data_type;
+
+  uint32_t value = htonl(s->value);
+  uint16_t short_value = htons(s->value);
+  switch (s->data_type)
+  {
+  case TYPE_INT:
+    message->content[0] = s->sign;
+    memcpy(message->content + 1, &value, sizeof(uint32_t));
+    break;
+  case TYPE_SHORT_REAL:
+    memcpy(message->content, &short_value, sizeof(uint16_t));
+    break;
+  case TYPE_FLOAT:
+    message->content[0] = s->sign;
+    memcpy(message->content + 1, &value, sizeof(uint32_t));
+    message->content[5] = s->power;
+    break;
+  case TYPE_STRING:
+    strcpy(message->content, s->text);
+    break;
+  }
+}
+
+static double elapsed_ns(chrono::steady_clock::time_point start)
+{
+  return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+  long iterations = argc > 1 ? atol(argv[1]) : 200000;
+
+  // A batch of messages, as one read of the subscriber would hold
+  vector<struct udp_message> messages(PAYLOAD_BATCH);
+  vector<struct payload_ref> refs(PAYLOAD_BATCH);
+  for (size_t i = 0; i < PAYLOAD_BATCH; i++)
+  {
+    encode(&samples[i % SAMPLE_COUNT], &messages[i]);
+    refs[i].topic = messages[i].topic;
+    refs[i].topic_len = strnlen(messages[i].topic, MAX_TOPIC_LEN);
+    refs[i].data_type = messages[i].data_type;
+    refs[i].content = messages[i].content;
+    refs[i].content_len = MAX_CONTENT_LEN;
+  }
+
+  // Both have to write the same text for every message
+  struct payload_value values[PAYLOAD_BATCH];
+  payload_decode_batch(refs.data(), PAYLOAD_BATCH, values);
+
+  int mismatches = 0;
+  for (size_t i = 0; i < SAMPLE_COUNT; i++)
+  {
+    char expected[MAX_PAYLOAD_TEXT_LEN], actual[MAX_PAYLOAD_TEXT_LEN];
+    int expected_len = legacy_format(expected, refs[i].topic, refs[i].topic_len, refs[i].data_type, refs[i].content, refs[i].content_len);
+    size_t actual_len = payload_format(actual, &refs[i], &values[i]);
+
+    if ((size_t)expected_len != actual_len || memcmp(expected, actual, actual_len) != 0)
+    {
+      fprintf(stderr, "Mismatch: %.*s instead of %.*s", (int)actual_len, actual, expected_len, expected);
+      mismatches++;
+    }
+  }
+
+  if (mismatches != 0)
+    return 1;
+
+  long lines = iterations * PAYLOAD_BATCH;
+  char out[MAX_PAYLOAD_TEXT_LEN];
+  volatile size_t sink = 0;
+
+  // The original functions and printf formatting
+  auto start = chrono::steady_clock::now();
+  for (long i = 0; i < iterations; i++)
+    for (size_t m = 0; m < PAYLOAD_BATCH; m++)
+      sink += legacy_format(out, refs[m].topic, refs[m].topic_len, refs[m].data_type, refs[m].content, refs[m].content_len);
+  double legacy_ns = elapsed_ns(start);
+
+  // One batch decode, then the table-driven formatting
+  start = chrono::steady_clock::now();
+  for (long i = 0; i < iterations; i++)
+  {
+    payload_decode_batch(refs.data(), PAYLOAD_BATCH, values);
+    for (size_t m = 0; m < PAYLOAD_BATCH; m++)
+      sink += payload_format(out, &refs[m], &values[m]);
+  }
+  double batch_ns = elapsed_ns(start);
+
+  printf("messages checked: %zu (identical text)\n", SAMPLE_COUNT);
+  printf("legacy   get_*_value + printf: %8.1f ns/message\n", legacy_ns / lines);
+  printf("batched  payload_format:       %8.1f ns/message\n", batch_ns / lines);
+  printf("speedup: %.1fx\n", legacy_ns / batch_ns);
+
+  return 0;
+}
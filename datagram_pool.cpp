@@ -0,0 +1,64 @@
+// Description: This file contains the batched receive of UDP datagrams
+#include "datagram_pool.h"
+
+#include <errno.h>
+#include <string.h>
+
+void datagram_pool_init(struct datagram_pool *pool)
+{
+  memset(pool->messages, 0, sizeof(pool->messages));
+
+  for (int i = 0; i < DATAGRAM_BATCH; i++)
+  {
+    pool->iov[i].iov_base = &pool->messages[i];
+    pool->iov[i].iov_len = sizeof(struct udp_message);
+
+    struct msghdr *header = &pool->headers[i].msg_hdr;
+    memset(header, 0, sizeof(struct msghdr));
+    header->msg_name = &pool->addrs[i];
+    header->msg_iov = &pool->iov[i];
+    header->msg_iovlen = 1;
+    header->msg_control = pool->control[i];
+  }
+
+  pool->drops = 0;
+}
+
+int datagram_pool_recv(struct datagram_pool *pool, int sockfd, int max)
+{
+  if (max > DATAGRAM_BATCH)
+    max = DATAGRAM_BATCH;
+
+  // recvmmsg overwrites the lengths of the address and of the control data
+  for (int i = 0; i < max; i++)
+  {
+    pool->headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    pool->headers[i].msg_hdr.msg_controllen = DATAGRAM_CONTROL_LEN;
+  }
+
+  int count;
+  do
+    count = recvmmsg(sockfd, pool->headers, max, MSG_DONTWAIT, NULL);
+  while (count < 0 && errno == EINTR);
+
+  if (count < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+  for (int i = 0; i < count; i++)
+  {
+    // The previous datagram received in the buffer may have been longer
+    size_t len = pool->headers[i].msg_len;
+    if (len < sizeof(struct udp_message))
+      memset((char *)&pool->messages[i] + len, 0, sizeof(struct udp_message) - len);
+
+    // The drop counter of the socket, if SO_RXQ_OVFL is enabled
+    struct msghdr *header = &pool->headers[i].msg_hdr;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(header); cmsg != NULL; cmsg = CMSG_NXTHDR(header, cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+        memcpy(&pool->drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+    }
+  }
+
+  return count;
+}
@@ -0,0 +1,40 @@
+// DATAGRAM_POOL -- Batched UDP receive into reusable buffers -- Header file
+#ifndef _DATAGRAM_POOL_H
+#define _DATAGRAM_POOL_H 1
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "po_udp.h"
+
+// Maximum number of datagrams received by one recvmmsg
+#define DATAGRAM_BATCH 64
+
+// Room for the SO_RXQ_OVFL counter attached to a datagram
+#define DATAGRAM_CONTROL_LEN CMSG_SPACE(sizeof(uint32_t))
+
+// Buffers for one batch of datagrams, allocated once and reused by every
+// receive, so that the memory of the ingest does not depend on the load
+struct datagram_pool
+{
+  struct udp_message messages[DATAGRAM_BATCH];
+  struct sockaddr_in addrs[DATAGRAM_BATCH];
+  struct iovec iov[DATAGRAM_BATCH];
+  struct mmsghdr headers[DATAGRAM_BATCH];
+  char control[DATAGRAM_BATCH][DATAGRAM_CONTROL_LEN];
+
+  // Datagrams the kernel dropped because the receive queue of the socket was
+  // full, as last reported by SO_RXQ_OVFL
+  uint32_t drops;
+};
+
+void datagram_pool_init(struct datagram_pool *pool);
+
+// Receives up to max (at most DATAGRAM_BATCH) datagrams without blocking
+// Datagram i is in messages[i], zero-filled after its headers[i].msg_len
+// bytes, and was sent from addrs[i]
+// Returns the number of datagrams, 0 if none was waiting, -1 on error
+int datagram_pool_recv(struct datagram_pool *pool, int sockfd, int max);
+
+#endif
@@ -0,0 +1,115 @@
+// Description: This file contains the encoding and parsing of PO_TCP v2 frames
+#include "headers.h"
+#include "frame.h"
+#include "payload.h"
+
+size_t udp_content_len(const struct udp_message *message, size_t content_received)
+{
+  if (message->data_type == TYPE_STRING)
+    return strnlen(message->content, MAX_CONTENT_LEN);
+
+  // Unknown types forward what was received
+  size_t len = payload_fixed_len(message->data_type);
+  return len != 0 ? len : content_received;
+}
+
+size_t frame_put_header(char *buf, uint8_t op_code, size_t body_len)
+{
+  size_t len = 0;
+
+  // Body length as a LEB128 varint, 7 bits per byte
+  do
+  {
+    uint8_t byte = body_len & 0x7f;
+    body_len >>= 7;
+    buf[len++] = byte | (body_len != 0 ? 0x80 : 0);
+  } while (body_len != 0);
+
+  buf[len++] = op_code;
+  return len;
+}
+
+size_t frame_build(char *buf, uint8_t op_code, const void *body, size_t body_len)
+{
+  size_t len = frame_put_header(buf, op_code, body_len);
+  memcpy(buf + len, body, body_len);
+  return len + body_len;
+}
+
+size_t frame_build_post(char *buf, const struct udp_message *message, size_t content_len, uint32_t ip, uint16_t port)
+{
+  size_t topic_len = strnlen(message->topic, MAX_TOPIC_LEN);
+  size_t len = frame_put_header(buf, POST, POST_FIXED_LEN + topic_len + content_len);
+
+  buf[len++] = topic_len;
+  memcpy(buf + len, message->topic, topic_len);
+  len += topic_len;
+
+  memcpy(buf + len, &ip, sizeof(ip));
+  len += sizeof(ip);
+  memcpy(buf + len, &port, sizeof(port));
+  len += sizeof(port);
+
+  buf[len++] = message->data_type;
+  memcpy(buf + len, message->content, content_len);
+  return len + content_len;
+}
+
+ssize_t frame_parse(const char *buf, size_t len, struct frame *frame)
+{
+  size_t body_len = 0;
+  size_t pos = 0;
+
+  // Decode the varint body length
+  while (1)
+  {
+    if (pos == len)
+      return 0;
+    if (pos == MAX_FRAME_HEADER_LEN - 1)
+      return -1;
+
+    uint8_t byte = buf[pos];
+    body_len |= (size_t)(byte & 0x7f) << (7 * pos);
+    pos++;
+
+    if ((byte & 0x80) == 0)
+      break;
+  }
+
+  if (body_len > MAX_FRAME_BODY_LEN)
+    return -1;
+
+  // The op_code and the whole body have to be in the buffer
+  if (len - pos < 1 + body_len)
+    return 0;
+
+  frame->op_code = buf[pos++];
+  frame->body = buf + pos;
+  frame->body_len = body_len;
+  return pos + body_len;
+}
+
+bool frame_parse_post(const struct frame *frame, struct post_view *post)
+{
+  const char *body = frame->body;
+  size_t len = frame->body_len;
+
+  if (len < POST_FIXED_LEN)
+    return false;
+
+  post->topic_len = body[0];
+  if (post->topic_len > MAX_TOPIC_LEN || len < POST_FIXED_LEN + post->topic_len)
+    return false;
+  post->topic = body + 1;
+
+  const char *pos = post->topic + post->topic_len;
+  memcpy(&post->udp_client_ip, pos, sizeof(post->udp_client_ip));
+  pos += sizeof(post->udp_client_ip);
+  memcpy(&post->udp_client_port, pos, sizeof(post->udp_client_port));
+  pos += sizeof(post->udp_client_port);
+
+  post->data_type = *pos++;
+  post->content = pos;
+  post->content_len = len - (pos - body);
+  return post->content_len <= MAX_CONTENT_LEN;
+}
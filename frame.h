@@ -0,0 +1,58 @@
+// FRAME -- Encoding and parsing of PO_TCP v2 frames -- Header file
+#ifndef _FRAME_H
+#define _FRAME_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "po_udp.h"
+
+// A frame that was received, pointing into the receive buffer
+struct frame
+{
+  uint8_t op_code;
+  const char *body;
+  size_t body_len;
+};
+
+// The body of a POST frame, pointing into the frame
+struct post_view
+{
+  const char *topic;
+  uint8_t topic_len;
+
+  // UDP client IP and port, in network byte order
+  uint32_t udp_client_ip;
+  uint16_t udp_client_port;
+
+  uint8_t data_type;
+  const char *content;
+  size_t content_len;
+};
+
+// Number of content bytes that are meaningful for a message of this type:
+// 5 for INT, 2 for SHORT_REAL, 6 for FLOAT and the string length for STRING
+// The message has to be zero-filled after the received bytes
+size_t udp_content_len(const struct udp_message *message, size_t content_received);
+
+// Writes the header of a frame with a body of body_len bytes
+// Returns the length of the header
+size_t frame_put_header(char *buf, uint8_t op_code, size_t body_len);
+
+// Writes a whole frame with the given body; returns the length of the frame
+size_t frame_build(char *buf, uint8_t op_code, const void *body, size_t body_len);
+
+// Writes a POST frame in buf (at least MAX_POST_FRAME_LEN bytes)
+// ip and port are in network byte order; returns the length of the frame
+size_t frame_build_post(char *buf, const struct udp_message *message, size_t content_len, uint32_t ip, uint16_t port);
+
+// Parses the frame at the start of buf
+// Returns the length of the frame, 0 if it was not received entirely yet,
+// or -1 if the data is not a valid frame
+ssize_t frame_parse(const char *buf, size_t len, struct frame *frame);
+
+// Parses the body of a POST frame; returns false if it is malformed
+bool frame_parse_post(const struct frame *frame, struct post_view *post);
+
+#endif
@@ -12,10 +12,21 @@
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
 #include <math.h>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
 
 using namespace std;
 
@@ -24,6 +35,21 @@ using namespace std;
 
 #define BUFLEN 61
 
+// Maximum number of events returned by one epoll_wait
+#define MAX_EVENTS 1024
+
+// Maximum number of reactor threads of the server
+#define MAX_THREADS 256
+
+// Datagrams read per wakeup of the UDP socket in level-triggered mode
+#define UDP_READ_BUDGET 256
+
+// Bytes of stored messages queued in one frame when a client is replayed
+#define REPLAY_BATCH_LEN (64 * 1024)
+
+// Chunks of the log replayed per flush of a connection, before the others run
+#define HISTORY_READ_BUDGET 4
+
 // TAKEN FROM LAB 7
 
 /*
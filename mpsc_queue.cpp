@@ -0,0 +1,60 @@
+// Description: This file contains the implementation of the MPSC queue
+#include "mpsc_queue.h"
+
+#include <stddef.h>
+
+void mpsc_queue_init(struct mpsc_queue *queue)
+{
+  queue->stub.next.store(NULL, std::memory_order_relaxed);
+  queue->tail.store(&queue->stub, std::memory_order_relaxed);
+  queue->head = &queue->stub;
+}
+
+void mpsc_queue_push(struct mpsc_queue *queue, struct mpsc_node *node)
+{
+  node->next.store(NULL, std::memory_order_relaxed);
+
+  // Take the place of the tail, then link the previous tail to the node
+  // Between the two steps the consumer sees the queue as ending before node
+  struct mpsc_node *prev = queue->tail.exchange(node, std::memory_order_acq_rel);
+  prev->next.store(node, std::memory_order_release);
+}
+
+struct mpsc_node *mpsc_queue_pop(struct mpsc_queue *queue)
+{
+  struct mpsc_node *head = queue->head;
+  struct mpsc_node *next = head->next.load(std::memory_order_acquire);
+
+  // Skip the stub
+  if (head == &queue->stub)
+  {
+    if (next == NULL)
+      return NULL;
+
+    queue->head = next;
+    head = next;
+    next = next->next.load(std::memory_order_acquire);
+  }
+
+  if (next != NULL)
+  {
+    queue->head = next;
+    return head;
+  }
+
+  // head is the last node linked; a push is in progress if it is not the tail
+  if (head != queue->tail.load(std::memory_order_acquire))
+    return NULL;
+
+  // Put the stub back behind head so that head can be popped
+  mpsc_queue_push(queue, &queue->stub);
+
+  next = head->next.load(std::memory_order_acquire);
+  if (next != NULL)
+  {
+    queue->head = next;
+    return head;
+  }
+
+  return NULL;
+}
@@ -0,0 +1,38 @@
+// MPSC_QUEUE -- Lock-free multi-producer single-consumer queue -- Header file
+#ifndef _MPSC_QUEUE_H
+#define _MPSC_QUEUE_H 1
+
+#include <atomic>
+
+// Link embedded as the first member of the items of a queue
+struct mpsc_node
+{
+  std::atomic<struct mpsc_node *> next;
+};
+
+// Intrusive queue (Vyukov): a push is one atomic exchange and never waits,
+// a pop is done by the single consumer without atomic read-modify-writes
+// Items pushed by one producer are popped in the order they were pushed
+struct mpsc_queue
+{
+  // Last pushed node, shared by the producers
+  alignas(64) std::atomic<struct mpsc_node *> tail;
+
+  // Next node to pop, owned by the consumer
+  alignas(64) struct mpsc_node *head;
+
+  // Placeholder that keeps the list non-empty
+  struct mpsc_node stub;
+};
+
+void mpsc_queue_init(struct mpsc_queue *queue);
+
+// Appends node; can be called by any thread
+void mpsc_queue_push(struct mpsc_queue *queue, struct mpsc_node *node);
+
+// Removes the oldest node; must only be called by the consumer thread
+// Returns NULL if the queue is empty or if the next node is still being
+// pushed, in which case its producer has not returned from push yet
+struct mpsc_node *mpsc_queue_pop(struct mpsc_queue *queue);
+
+#endif
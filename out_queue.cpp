@@ -0,0 +1,122 @@
+// Description: This file contains the implementation of the outbound queues
+#include "out_queue.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <new>
+
+struct shared_frame *shared_frame_alloc(size_t len)
+{
+  struct shared_frame *frame = (struct shared_frame *)malloc(sizeof(struct shared_frame) + len);
+  if (frame == NULL)
+    abort();
+
+  new (&frame->refs) std::atomic<uint32_t>(1);
+  frame->len = len;
+  return frame;
+}
+
+struct shared_frame *shared_frame_new(const void *data, size_t len)
+{
+  struct shared_frame *frame = shared_frame_alloc(len);
+  memcpy(shared_frame_data(frame), data, len);
+  return frame;
+}
+
+void shared_frame_ref(struct shared_frame *frame)
+{
+  frame->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void shared_frame_unref(struct shared_frame *frame)
+{
+  if (frame->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    free(frame);
+}
+
+void out_queue_init(struct out_queue *queue)
+{
+  out_queue_clear(queue);
+}
+
+void out_queue_push(struct out_queue *queue, const void *data, size_t len)
+{
+  // The new frame's reference is the queue's
+  queue->frames.push_back(shared_frame_new(data, len));
+  queue->bytes += len;
+}
+
+void out_queue_push_shared(struct out_queue *queue, struct shared_frame *frame)
+{
+  shared_frame_ref(frame);
+  queue->frames.push_back(frame);
+  queue->bytes += frame->len;
+}
+
+int out_queue_flush(struct out_queue *queue, int sockfd)
+{
+  while (queue->bytes > 0)
+  {
+    // Gather the pending frames, starting with what is left of the first one
+    struct iovec iov[OUT_QUEUE_MAX_IOV];
+    size_t offered = 0;
+    int count = 0;
+    for (auto it = queue->frames.begin(); it != queue->frames.end() && count < OUT_QUEUE_MAX_IOV; ++it, ++count)
+    {
+      size_t skip = count == 0 ? queue->head_offset : 0;
+      iov[count].iov_base = shared_frame_data(*it) + skip;
+      iov[count].iov_len = (*it)->len - skip;
+      offered += iov[count].iov_len;
+    }
+
+    ssize_t sent = writev(sockfd, iov, count);
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;
+      return -1;
+    }
+
+    queue->bytes -= sent;
+
+    // Release the frames that were sent entirely
+    size_t left = sent + queue->head_offset;
+    while (!queue->frames.empty() && left >= queue->frames.front()->len)
+    {
+      left -= queue->frames.front()->len;
+      shared_frame_unref(queue->frames.front());
+      queue->frames.pop_front();
+    }
+    queue->head_offset = left;
+
+    // The socket took less than offered, it is full
+    if ((size_t)sent < offered)
+      return 1;
+  }
+
+  return 0;
+}
+
+void out_queue_splice(struct out_queue *dst, struct out_queue *src)
+{
+  // The references move with the frames
+  dst->frames.insert(dst->frames.end(), src->frames.begin(), src->frames.end());
+  dst->bytes += src->bytes;
+
+  src->frames.clear();
+  src->bytes = 0;
+}
+
+void out_queue_clear(struct out_queue *queue)
+{
+  for (struct shared_frame *frame : queue->frames)
+    shared_frame_unref(frame);
+
+  queue->frames.clear();
+  queue->head_offset = 0;
+  queue->bytes = 0;
+}
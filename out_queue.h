@@ -0,0 +1,69 @@
+// OUT_QUEUE -- Outbound queue of a non-blocking socket -- Header file
+#ifndef _OUT_QUEUE_H
+#define _OUT_QUEUE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+
+// Maximum number of frames gathered by one writev
+#define OUT_QUEUE_MAX_IOV 256
+
+// An encoded frame, immutable once built, shared by the queues of all the
+// subscribers it is sent to; it is freed when the last reference is dropped
+struct shared_frame
+{
+  std::atomic<uint32_t> refs;
+  size_t len;
+};
+
+// Allocates a frame of len bytes with one reference; the bytes follow the
+// header and have to be written before the frame is queued
+struct shared_frame *shared_frame_alloc(size_t len);
+
+// Same, with a copy of data
+struct shared_frame *shared_frame_new(const void *data, size_t len);
+
+static inline char *shared_frame_data(struct shared_frame *frame)
+{
+  return (char *)(frame + 1);
+}
+
+void shared_frame_ref(struct shared_frame *frame);
+void shared_frame_unref(struct shared_frame *frame);
+
+struct out_queue
+{
+  // Frames waiting to be sent, the first one may be partially sent
+  // The queue holds one reference on each of them
+  std::deque<struct shared_frame *> frames;
+
+  // Bytes of the first frame that were already sent
+  size_t head_offset;
+
+  // Bytes waiting to be sent
+  size_t bytes;
+};
+
+void out_queue_init(struct out_queue *queue);
+
+// Appends a copy of a frame at the end of the queue
+void out_queue_push(struct out_queue *queue, const void *data, size_t len);
+
+// Appends a shared frame at the end of the queue, taking a new reference
+void out_queue_push_shared(struct out_queue *queue, struct shared_frame *frame);
+
+// Sends as much of the queue as the socket accepts, gathering the pending
+// frames in writev calls
+// Returns 0 if the queue was emptied, 1 if the socket is full and -1 if the
+// connection failed
+int out_queue_flush(struct out_queue *queue, int sockfd);
+
+// Moves the frames of src, none of them started, at the end of dst
+void out_queue_splice(struct out_queue *dst, struct out_queue *src);
+
+// Drops everything that was not sent yet
+void out_queue_clear(struct out_queue *queue);
+
+#endif
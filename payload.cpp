@@ -0,0 +1,212 @@
+// Description: This file contains the decoding and formatting of the UDP message contents
+#include "payload.h"
+
+#include <endian.h>
+#include <string.h>
+#include <charconv>
+
+// Powers of ten that fit in 64 bits
+static const uint64_t pow10_table[] = {
+    1ULL,
+    10ULL,
+    100ULL,
+    1000ULL,
+    10000ULL,
+    100000ULL,
+    1000000ULL,
+    10000000ULL,
+    100000000ULL,
+    1000000000ULL,
+    10000000000ULL,
+    100000000000ULL,
+    1000000000000ULL,
+    10000000000000ULL,
+    100000000000000ULL,
+    1000000000000000ULL,
+    10000000000000000ULL,
+    100000000000000000ULL,
+    1000000000000000000ULL,
+    10000000000000000000ULL,
+};
+
+// Decimals printed for SHORT_REAL and FLOAT
+#define SHORT_REAL_DECIMALS 2
+#define FLOAT_DECIMALS 4
+
+size_t payload_fixed_len(uint8_t data_type)
+{
+  switch (data_type)
+  {
+  case TYPE_INT:
+    // Sign byte + uint32_t
+    return 5;
+  case TYPE_SHORT_REAL:
+    // uint16_t
+    return 2;
+  case TYPE_FLOAT:
+    // Sign byte + uint32_t + power of 10
+    return 6;
+  default:
+    return 0;
+  }
+}
+
+void payload_decode(const struct payload_ref *ref, struct payload_value *value)
+{
+  payload_decode_batch(ref, 1, value);
+}
+
+void payload_decode_batch(const struct payload_ref *refs, size_t count, struct payload_value *values)
+{
+  uint32_t words[PAYLOAD_BATCH];
+
+  // Gather the big-endian word of every numeric content
+  for (size_t i = 0; i < count; i++)
+  {
+    const struct payload_ref *ref = &refs[i];
+    struct payload_value *value = &values[i];
+    words[i] = 0;
+
+    if (ref->data_type > TYPE_STRING)
+    {
+      value->status = PAYLOAD_BAD_TYPE;
+      continue;
+    }
+
+    if (ref->content_len < payload_fixed_len(ref->data_type))
+    {
+      value->status = PAYLOAD_SHORT;
+      continue;
+    }
+
+    value->status = PAYLOAD_OK;
+    value->negative = false;
+    value->power = 0;
+
+    if (ref->data_type == TYPE_INT || ref->data_type == TYPE_FLOAT)
+    {
+      value->negative = ref->content[0] != 0;
+      memcpy(&words[i], ref->content + 1, sizeof(uint32_t));
+    }
+    else if (ref->data_type == TYPE_SHORT_REAL)
+    {
+      // The two bytes become the high half of the word once swapped
+      memcpy(&words[i], ref->content, sizeof(uint16_t));
+    }
+  }
+
+  // A plain loop over the words, that the compiler turns into vector
+  // byte shuffles
+  for (size_t i = 0; i < count; i++)
+    words[i] = be32toh(words[i]);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    const struct payload_ref *ref = &refs[i];
+    struct payload_value *value = &values[i];
+    if (value->status != PAYLOAD_OK)
+      continue;
+
+    switch (ref->data_type)
+    {
+    case TYPE_INT:
+      value->magnitude = words[i];
+      break;
+    case TYPE_SHORT_REAL:
+      value->magnitude = words[i] >> 16;
+      value->power = SHORT_REAL_DECIMALS;
+      break;
+    case TYPE_FLOAT:
+      value->magnitude = words[i];
+      value->power = (uint8_t)ref->content[5];
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+// Writes a decimal number with exactly decimals digits after the point,
+// rounding magnitude / 10^power half to even like printf does
+static char *format_fixed(char *out, uint32_t magnitude, uint8_t power, uint8_t decimals)
+{
+  uint64_t scaled;
+  if (power <= decimals)
+  {
+    scaled = magnitude * pow10_table[decimals - power];
+  }
+  else if (power - decimals >= 19)
+  {
+    // Even the largest magnitude is below half of the last decimal
+    scaled = 0;
+  }
+  else
+  {
+    uint64_t divisor = pow10_table[power - decimals];
+    scaled = magnitude / divisor;
+    uint64_t rest = magnitude % divisor;
+    if (rest * 2 > divisor || (rest * 2 == divisor && (scaled & 1)))
+      scaled++;
+  }
+
+  uint64_t unit = pow10_table[decimals];
+  out = std::to_chars(out, out + 20, scaled / unit).ptr;
+  *out++ = '.';
+
+  // The decimals, with their leading zeros
+  uint64_t fraction = scaled % unit;
+  for (int digit = decimals - 1; digit >= 0; digit--)
+  {
+    out[digit] = '0' + fraction % 10;
+    fraction /= 10;
+  }
+
+  return out + decimals;
+}
+
+size_t payload_format(char *out, const struct payload_ref *ref, const struct payload_value *value)
+{
+  if (value->status != PAYLOAD_OK)
+    return 0;
+
+  static const char *type_names[] = {" - INT - ", " - SHORT_REAL - ", " - FLOAT - ", " - STRING - "};
+  char *p = out;
+
+  // FORMAT: "<TOPIC> - <TIP_DATE> - <VALOARE_MESAJ>"
+  memcpy(p, ref->topic, ref->topic_len);
+  p += ref->topic_len;
+
+  const char *type_name = type_names[ref->data_type];
+  size_t type_len = strlen(type_name);
+  memcpy(p, type_name, type_len);
+  p += type_len;
+
+  switch (ref->data_type)
+  {
+  case TYPE_INT:
+    // A negative zero is printed as 0, as the int it used to be
+    if (value->negative && value->magnitude != 0)
+      *p++ = '-';
+    p = std::to_chars(p, p + 10, value->magnitude).ptr;
+    break;
+  case TYPE_SHORT_REAL:
+    p = format_fixed(p, value->magnitude, value->power, SHORT_REAL_DECIMALS);
+    break;
+  case TYPE_FLOAT:
+    // printf writes the sign of a negative zero float
+    if (value->negative)
+      *p++ = '-';
+    p = format_fixed(p, value->magnitude, value->power, FLOAT_DECIMALS);
+    break;
+  case TYPE_STRING:
+  {
+    size_t len = strnlen(ref->content, ref->content_len);
+    memcpy(p, ref->content, len);
+    p += len;
+    break;
+  }
+  }
+
+  *p++ = '\n';
+  return p - out;
+}
@@ -0,0 +1,60 @@
+// PAYLOAD -- Decoding and text formatting of the UDP message contents -- Header file
+#ifndef _PAYLOAD_H
+#define _PAYLOAD_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "po_udp.h"
+
+// Longest line written by payload_format: topic, type name, separators and
+// a STRING content, or a number with its sign and decimals
+#define MAX_PAYLOAD_TEXT_LEN (MAX_TOPIC_LEN + MAX_CONTENT_LEN + 32)
+
+// Messages decoded by one payload_decode_batch call at most
+#define PAYLOAD_BATCH 64
+
+// Outcome of the decoding of a content
+#define PAYLOAD_OK 0
+#define PAYLOAD_SHORT 1
+#define PAYLOAD_BAD_TYPE 2
+
+// A message to decode, pointing into the receive buffer
+struct payload_ref
+{
+  const char *topic;
+  size_t topic_len;
+
+  uint8_t data_type;
+  const char *content;
+  size_t content_len;
+};
+
+// A decoded numeric content: magnitude / 10^power, with a sign
+// STRING contents are not decoded, they are copied by payload_format
+struct payload_value
+{
+  uint8_t status;
+  bool negative;
+  uint32_t magnitude;
+  uint8_t power;
+};
+
+// Bytes of content a numeric type needs: 5 for INT, 2 for SHORT_REAL and 6
+// for FLOAT; 0 for STRING and the unknown types
+size_t payload_fixed_len(uint8_t data_type);
+
+// Decodes the content of one message
+void payload_decode(const struct payload_ref *ref, struct payload_value *value);
+
+// Decodes count messages (at most PAYLOAD_BATCH); the big-endian words of
+// all the numeric contents are gathered and byte-swapped in one pass
+void payload_decode_batch(const struct payload_ref *refs, size_t count, struct payload_value *values);
+
+// Writes "<TOPIC> - <TYPE> - <VALUE>\n" for a decoded message, in the format
+// of printf("%d"), "%.2f" and "%.4f" but with the exact decimal value
+// out needs MAX_PAYLOAD_TEXT_LEN bytes
+// Returns the length of the line, 0 if the value was not decoded
+size_t payload_format(char *out, const struct payload_ref *ref, const struct payload_value *value);
+
+#endif
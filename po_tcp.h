@@ -2,7 +2,7 @@
 #ifndef _PO_TCP_H
 #define _PO_TCP_H 1
 
-#pragma pack(1)
+#pragma pack(push, 1)
 
 #include "po_udp.h"
 
@@ -17,6 +17,42 @@
 #define CONNECT_ACK 6
 #define DISCONNECT 7
 
+// SUBSCRIBE with store-and-forward: the messages published while the client
+// is offline are sent when it reconnects; acknowledged with SUBSCRIBE_ACK
+#define SUBSCRIBE_SF 8
+
+// SUBSCRIBE with a replay of the log of the server: the logged messages from
+// an offset or a time are sent before the live ones; acknowledged with
+// SUBSCRIBE_ACK
+// Body: kind (1 byte) | value (8 bytes, big endian) | topic
+// In v1, kind goes in the data_type field and value in the content field
+#define SUBSCRIBE_FROM 9
+#define SUBSCRIBE_FROM_LEN 9
+
+// Kinds of SUBSCRIBE_FROM: value is a log offset, or microseconds since the epoch
+#define FROM_OFFSET 0
+#define FROM_TIME 1
+
+// PO_TCP v2 -- length-prefixed frames, negotiated on CONNECT
+// A v2 frame is: body length (LEB128 varint) | op_code (1 byte) | body
+#define PO_TCP_V1 1
+#define PO_TCP_V2 2
+
+// Sent in the topic field of the v1 CONNECT by a client that speaks v2, and
+// echoed in the topic field of the v1 CONNECT_ACK by a server that accepts it
+#define PO_TCP_V2_MAGIC "PO_TCP/2"
+
+// Longest varint header and biggest body accepted in a v2 frame
+#define MAX_FRAME_HEADER_LEN 5
+#define MAX_FRAME_BODY_LEN (1 << 22)
+
+// Body of a v2 POST frame: topic length (1) | topic | UDP client IP (4) |
+// UDP client port (2) | data type (1) | content (only the meaningful bytes)
+#define POST_FIXED_LEN (1 + 4 + 2 + 1)
+#define MAX_POST_FRAME_LEN (MAX_FRAME_HEADER_LEN + POST_FIXED_LEN + MAX_TOPIC_LEN + MAX_CONTENT_LEN)
+
+struct sf_store;
+
 struct tcp_client
 {
     // Client ID
@@ -34,8 +70,19 @@ struct tcp_client
     // Socket file descriptor
     int sockfd;
 
+    // Reactor thread of the server that owns the socket
+    int shard;
+
+    // Incremented at every CONNECT of the ID, so that a socket of an older
+    // session is not taken for the current one
+    uint32_t generation;
+
     // Topics subscribed by the client
-    vector<string> topics_subscribed;
+    unordered_set<string> topics_subscribed;
+
+    // Messages kept while the client is offline, NULL until it subscribes
+    // with store-and-forward
+    struct sf_store *store;
 };
 
 struct tcp_message
@@ -57,4 +104,6 @@ struct tcp_message
     char id[MAX_ID_LEN];
 };
 
+#pragma pack(pop)
+
 #endif
\ No newline at end of file
@@ -5,7 +5,7 @@
 #define MAX_CONTENT_LEN 1500
 #define MAX_TOPIC_LEN 50
 
-#pragma pack(1)
+#pragma pack(push, 1)
 
 #define TYPE_INT 0
 #define TYPE_SHORT_REAL 1
@@ -19,4 +19,6 @@ struct udp_message
   char content[MAX_CONTENT_LEN];
 };
 
+#pragma pack(pop)
+
 #endif
\ No newline at end of file
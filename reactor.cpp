@@ -0,0 +1,102 @@
+// Description: This file contains the implementation of the epoll reactor
+#include "reactor.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+// Packs a descriptor and its registration generation in the epoll user data
+static inline uint64_t reactor_key(int fd, uint32_t generation)
+{
+  return ((uint64_t)generation << 32) | (uint32_t)fd;
+}
+
+int reactor_init(struct reactor *r, bool edge_triggered, int max_events)
+{
+  r->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (r->epfd < 0)
+    return -1;
+
+  r->edge_triggered = edge_triggered;
+  r->entries.clear();
+  r->events.resize(max_events);
+  return 0;
+}
+
+int reactor_add(struct reactor *r, int fd, uint32_t events, reactor_handler handler, void *ctx)
+{
+  // Grow the handler table so that it can be indexed by fd
+  if ((size_t)fd >= r->entries.size())
+    r->entries.resize(fd + 1, {NULL, NULL, 0});
+
+  struct reactor_entry *entry = &r->entries[fd];
+  entry->generation++;
+
+  struct epoll_event ev;
+  ev.events = events | (r->edge_triggered ? EPOLLET : 0);
+  ev.data.u64 = reactor_key(fd, entry->generation);
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    return -1;
+
+  entry->handler = handler;
+  entry->ctx = ctx;
+  return 0;
+}
+
+int reactor_modify(struct reactor *r, int fd, uint32_t events)
+{
+  if ((size_t)fd >= r->entries.size() || r->entries[fd].handler == NULL)
+  {
+    errno = ENOENT;
+    return -1;
+  }
+
+  struct epoll_event ev;
+  ev.events = events | (r->edge_triggered ? EPOLLET : 0);
+  ev.data.u64 = reactor_key(fd, r->entries[fd].generation);
+  return epoll_ctl(r->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int reactor_remove(struct reactor *r, int fd)
+{
+  if ((size_t)fd >= r->entries.size() || r->entries[fd].handler == NULL)
+  {
+    errno = ENOENT;
+    return -1;
+  }
+
+  // Invalidate events for fd that are still pending in the current batch
+  r->entries[fd].handler = NULL;
+  r->entries[fd].ctx = NULL;
+  r->entries[fd].generation++;
+
+  return epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int reactor_poll(struct reactor *r, int timeout)
+{
+  int n = epoll_wait(r->epfd, r->events.data(), r->events.size(), timeout);
+  if (n < 0)
+    return errno == EINTR ? 0 : -1;
+
+  // Only the descriptors that are ready are visited
+  for (int i = 0; i < n; i++)
+  {
+    int fd = (int)(uint32_t)r->events[i].data.u64;
+    uint32_t generation = (uint32_t)(r->events[i].data.u64 >> 32);
+
+    struct reactor_entry *entry = &r->entries[fd];
+    if (entry->handler == NULL || entry->generation != generation)
+      continue;
+
+    entry->handler(fd, r->events[i].events, entry->ctx);
+  }
+
+  return n;
+}
+
+void reactor_close(struct reactor *r)
+{
+  close(r->epfd);
+  r->entries.clear();
+  r->events.clear();
+}
@@ -0,0 +1,57 @@
+// REACTOR -- epoll based event loop -- Header file
+#ifndef _REACTOR_H
+#define _REACTOR_H 1
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <vector>
+
+// Handler called for a ready file descriptor with the epoll events that fired
+typedef void (*reactor_handler)(int fd, uint32_t events, void *ctx);
+
+struct reactor_entry
+{
+  // Handler and its context, NULL if the descriptor is not registered
+  reactor_handler handler;
+  void *ctx;
+
+  // Generation of the registration, used to drop stale events for a
+  // descriptor that was closed (and maybe reused) in the same wakeup
+  uint32_t generation;
+};
+
+struct reactor
+{
+  // The epoll instance
+  int epfd;
+
+  // Edge-triggered (EPOLLET) or level-triggered registrations
+  bool edge_triggered;
+
+  // Registered handlers, indexed by file descriptor
+  std::vector<struct reactor_entry> entries;
+
+  // Buffer for the events returned by epoll_wait
+  std::vector<struct epoll_event> events;
+};
+
+// Creates the epoll instance; returns -1 on error
+int reactor_init(struct reactor *r, bool edge_triggered, int max_events);
+
+// Registers fd for the given events (EPOLLIN, EPOLLOUT, ...)
+int reactor_add(struct reactor *r, int fd, uint32_t events, reactor_handler handler, void *ctx);
+
+// Changes the events fd is registered for
+int reactor_modify(struct reactor *r, int fd, uint32_t events);
+
+// Unregisters fd; must be called before closing it
+int reactor_remove(struct reactor *r, int fd);
+
+// Waits for events and dispatches them to their handlers
+// Returns the number of events dispatched or -1 on error
+int reactor_poll(struct reactor *r, int timeout);
+
+// Closes the epoll instance
+void reactor_close(struct reactor *r);
+
+#endif
@@ -1,482 +1,1617 @@
 // Description: This file contains the implementation of the UDP/TCP server
 #include "headers.h"
 #include "utils.h"
+#include "reactor.h"
+#include "topic_trie.h"
+#include "frame.h"
+#include "out_queue.h"
+#include "mpsc_queue.h"
+#include "datagram_pool.h"
+#include "sf_store.h"
+#include "topic_log.h"
+#include "stats.h"
+
+// Information about a TCP connection accepted by the server
+struct connection
+{
+  // True while the socket is open and registered in the reactor
+  bool open;
+
+  // Index of the client in the clients vector, -1 until CONNECT is received
+  int client;
+
+  // Generation of the client's session on this connection
+  uint32_t generation;
+
+  // Protocol spoken on the connection, PO_TCP_V1 until CONNECT negotiates v2
+  uint8_t version;
+
+  // TCP client IP and port
+  char ip[INET_ADDRSTRLEN];
+  uint16_t port;
+
+  // Bytes received from the socket that do not form a whole message yet
+  string in_buf;
+
+  // Frames waiting to be sent on the non-blocking socket
+  struct out_queue out;
+
+  // The connection is in the list of queues to flush after this wakeup
+  bool dirty;
+
+  // The queue could not be emptied, the socket is watched for EPOLLOUT
+  bool writing;
+
+  // Bytes of the queue counted in the statistics at the last flush
+  size_t reported_bytes;
+
+  // Replay of the log asked by SUBSCRIBE_FROM, NULL if there is none
+  // The frames queued meanwhile wait in held and are sent after it
+  struct history *history;
+  struct out_queue held;
+};
+
+// Frames queued in batches, for the replays of stored messages and of the log
+struct replay
+{
+  struct server_state *state;
+  int sockfd;
+
+  // Frames not queued yet
+  char batch[REPLAY_BATCH_LEN];
+  size_t batch_len;
+};
 
-// Function that checks if two topics are matching
-// Inclunding regexes such as "+" or "*"
-bool topics_are_matching(const char *topic1, const char *topic2)
+// A replay of the log for one subscription
+struct history
 {
-  // If the topics are the same, return true
-  if (strcmp(topic1, topic2) == 0)
-    return true;
+  struct log_cursor cursor;
+  struct topic_pattern pattern;
+  struct replay replay;
+};
+
+// A subscriber of a POST, found while the clients were locked
+struct post_target
+{
+  // Index of the client, and the socket and session it was connected with
+  int client;
+  int sockfd;
+  uint32_t generation;
+};
+
+// A UDP message handed to the reactor thread that owns some of its subscribers
+struct routed_post
+{
+  // Link in the inbox of the thread, must stay the first member
+  struct mpsc_node node;
+
+  struct udp_message message;
+  size_t content_len;
+  struct sockaddr_in udp_client_addr;
+
+  // Time stamp of the receive of the datagram
+  uint64_t received_at;
+
+  // Subscribers owned by the thread the POST is routed to
+  vector<struct post_target> targets;
+};
+
+struct server_state;
+
+// State shared by the reactor threads
+struct broker
+{
+  // Guards clients and subscriptions: UDP messages are matched under the
+  // shared lock, connections and subscriptions change under the exclusive one
+  shared_mutex lock;
+
+  // Current and past TCP clients; a client keeps its index for good
+  vector<struct tcp_client> clients;
+
+  // Index of the clients by ID
+  unordered_map<string, int> client_ids;
+
+  // Index of the subscriptions of all the clients
+  struct topic_trie subscriptions;
+
+  // Subscriptions made with store-and-forward, also in subscriptions
+  struct topic_trie sf_subscriptions;
+
+  // Directory of the files the stores of offline clients spill to
+  const char *spill_dir;
 
-  // Create two copies of the topics
-  char *topic1_copy = strdup(topic1);
-  char *topic2_copy = strdup(topic2);
+  // Log of the published messages, NULL if it is disabled
+  struct topic_log *log;
 
-  // If the topics are different, take tokens from them
-  vector<string> tokens1;
-  vector<string> tokens2;
+  // Reactor threads; each one owns the connections it accepted
+  vector<struct server_state *> shards;
 
-  // Tokenize the first topic
-  char *token = strtok(topic1_copy, "/");
-  while (token != NULL)
+  // Unix socket that dumps the statistics as JSON, -1 if there is none
+  int stats_fd;
+  const char *stats_path;
+
+  // Set to false when the server has to stop
+  atomic<bool> running;
+};
+
+// State of one reactor thread, shared by all its handlers
+struct server_state
+{
+  struct broker *broker;
+
+  // Index of the thread in broker->shards
+  int shard;
+
+  // Event loop
+  struct reactor reactor;
+
+  // Listening TCP socket and UDP socket of the thread
+  int tcp_sockfd;
+  int udp_sockfd;
+
+  // POSTs routed here by the other threads, and the eventfd that wakes the
+  // thread; inbox_signalled is set while a wakeup is pending
+  struct mpsc_queue inbox;
+  int inbox_fd;
+  atomic<bool> inbox_signalled;
+
+  // Buffers the UDP socket is drained into
+  struct datagram_pool udp_pool;
+
+  // Kernel drops of the UDP socket that were already reported, and when
+  uint32_t reported_drops;
+  time_t drops_reported_at;
+
+  // Clients matched by the last UDP message, and the ones matched by a
+  // store-and-forward subscription when some of them were offline
+  vector<int> matched;
+  vector<int> sf_matched;
+  struct trie_matcher matcher;
+
+  // Subscribers of the last UDP message owned by this thread, and the POSTs
+  // being built for the other threads (NULL if they own none)
+  vector<struct post_target> local;
+  vector<struct routed_post *> outgoing;
+
+  // Open connections, indexed by socket file descriptor
+  vector<struct connection> connections;
+
+  // Connections with frames queued during the current wakeup
+  vector<int> dirty;
+
+  // Statistics of the thread, and the time stamp of the receive of the
+  // oldest datagram queued during the current wakeup (0 if none)
+  struct shard_stats stats;
+  uint64_t oldest_queued;
+};
+
+// Closes a TCP connection and marks its client as disconnected
+void close_connection(struct server_state *state, int sockfd)
+{
+  struct connection *conn = &state->connections[sockfd];
+
+  if (conn->client >= 0)
   {
-    tokens1.push_back(token);
-    token = strtok(NULL, "/");
+    unique_lock<shared_mutex> guard(state->broker->lock);
+    state->broker->clients[conn->client].connected = false;
   }
 
-  // Tokenize the second topic
-  token = strtok(topic2_copy, "/");
-  while (token != NULL)
+  reactor_remove(&state->reactor, sockfd);
+  close(sockfd);
+
+  conn->open = false;
+  conn->client = -1;
+  conn->in_buf.clear();
+  out_queue_clear(&conn->out);
+  conn->dirty = false;
+
+  stat_add(state->stats.connections, -1);
+  stat_add(state->stats.queued_bytes, -(int64_t)conn->reported_bytes);
+  if (conn->writing)
+    stat_add(state->stats.slow_connections, -1);
+  conn->writing = false;
+  conn->reported_bytes = 0;
+
+  delete conn->history;
+  conn->history = NULL;
+  out_queue_clear(&conn->held);
+}
+
+// Closes a TCP connection that was lost or broke the protocol
+void drop_connection(struct server_state *state, int sockfd)
+{
+  int client = state->connections[sockfd].client;
+  close_connection(state, sockfd);
+
+  if (client >= 0)
   {
-    tokens2.push_back(token);
-    token = strtok(NULL, "/");
+    shared_lock<shared_mutex> guard(state->broker->lock);
+    fprintf(stdout, "Client %.*s disconnected.\n", MAX_ID_LEN, state->broker->clients[client].id);
   }
+}
 
-  // Check if the tokens are matching
-  int index_tokens1 = 0, index_tokens2 = 0;
-  while (index_tokens1 < tokens1.size() && index_tokens2 < tokens2.size())
+void pump_history(struct server_state *state, int sockfd);
+
+// Sends the queued frames of a connection, without blocking
+// Watches the socket for EPOLLOUT while the queue can not be emptied, or
+// while a replay of the log is in progress
+// Returns false if the connection was closed
+bool flush_connection(struct server_state *state, int sockfd)
+{
+  struct connection *conn = &state->connections[sockfd];
+  int budget = HISTORY_READ_BUDGET;
+  int rc;
+
+  while (1)
   {
-    // If the tokens are matching or the token in first vector is "+", continue
-    if (tokens1[index_tokens1] == tokens2[index_tokens2] || tokens1[index_tokens1] == "+")
+    rc = out_queue_flush(&conn->out, sockfd);
+    if (rc < 0)
     {
-      index_tokens1++;
-      index_tokens2++;
+      // A failed client only loses its own connection
+      drop_connection(state, sockfd);
+      return false;
     }
-    else if (tokens1[index_tokens1] == "*")
+
+    // The log is read further only once what was read of it was sent
+    if (rc > 0 || conn->history == NULL)
+      break;
+
+    // Let the other connections run, EPOLLOUT brings the replay back
+    if (budget-- == 0)
     {
-      // If the "*" token is the last token in the first vector, return true
-      if (index_tokens1 == tokens1.size() - 1)
-        return true;
+      rc = 1;
+      break;
+    }
+
+    pump_history(state, sockfd);
+  }
+
+  // Modifying the registration also re-arms EPOLLOUT in edge-triggered mode,
+  // where the socket that is still writable would not fire again
+  // Only the queues of the slow connections are not empty after a flush
+  stat_add(state->stats.queued_bytes, (int64_t)conn->out.bytes - (int64_t)conn->reported_bytes);
+  conn->reported_bytes = conn->out.bytes;
+
+  bool writing = rc > 0;
+  if (writing != conn->writing)
+    stat_add(state->stats.slow_connections, writing ? 1 : -1);
+
+  if (writing != conn->writing || conn->history != NULL)
+  {
+    rc = reactor_modify(&state->reactor, sockfd, writing ? EPOLLIN | EPOLLOUT : EPOLLIN);
+    DIE(rc < 0, "Modify TCP client in epoll ERROR");
+    conn->writing = writing;
+  }
+
+  return true;
+}
+
+// Flushes the queues that received frames during the current wakeup, so that
+// all the frames for a client are gathered in one writev
+void flush_dirty_connections(struct server_state *state)
+{
+  for (int sockfd : state->dirty)
+  {
+    struct connection *conn = &state->connections[sockfd];
+    if (!conn->dirty)
+      continue;
 
-      // Get the next token after the "*" token
-      string next = tokens1[index_tokens1 + 1];
+    conn->dirty = false;
+    if (conn->open && !conn->writing)
+      flush_connection(state, sockfd);
+  }
+
+  state->dirty.clear();
+}
+
+// Adds a connection to the ones flushed at the end of the wakeup
+void mark_dirty(struct server_state *state, int sockfd)
+{
+  struct connection *conn = &state->connections[sockfd];
+  if (!conn->dirty && !conn->writing)
+  {
+    conn->dirty = true;
+    state->dirty.push_back(sockfd);
+  }
+}
 
-      // Check if the next token after "*" is "+"
-      if (next == "+")
+// Queues a frame for a connection; it is sent at the end of the wakeup, or
+// when the socket becomes writable if the client is slow
+// During a replay of the log, it is kept until the replay ends
+void queue_frame(struct server_state *state, int sockfd, const void *data, size_t len)
+{
+  struct connection *conn = &state->connections[sockfd];
+  if (conn->history != NULL)
+  {
+    out_queue_push(&conn->held, data, len);
+    return;
+  }
+
+  out_queue_push(&conn->out, data, len);
+  mark_dirty(state, sockfd);
+}
+
+// Same, for a frame shared with other connections
+void queue_shared_frame(struct server_state *state, int sockfd, struct shared_frame *frame)
+{
+  struct connection *conn = &state->connections[sockfd];
+  if (conn->history != NULL)
+  {
+    out_queue_push_shared(&conn->held, frame);
+    return;
+  }
+
+  out_queue_push_shared(&conn->out, frame);
+  mark_dirty(state, sockfd);
+}
+
+// Queues a message without a payload in the protocol of the connection
+// topic is used only for SUBSCRIBE_ACK and UNSUBSCRIBE_ACK
+void queue_control(struct server_state *state, int sockfd, uint8_t op_code, const char *topic, size_t topic_len)
+{
+  if (state->connections[sockfd].version == PO_TCP_V2)
+  {
+    char buffer[MAX_FRAME_HEADER_LEN + MAX_TOPIC_LEN];
+    size_t len = frame_build(buffer, op_code, topic, topic_len);
+    queue_frame(state, sockfd, buffer, len);
+    return;
+  }
+
+  struct tcp_message response;
+  memset(&response, 0, sizeof(struct tcp_message));
+  response.op_code = op_code;
+  if (topic_len > 0)
+    memcpy(response.topic, topic, topic_len);
+  queue_frame(state, sockfd, &response, sizeof(struct tcp_message));
+}
+
+void end_history(struct server_state *state, int sockfd);
+
+// Sends a last DISCONNECT message and closes the connection
+void disconnect_connection(struct server_state *state, int sockfd)
+{
+  struct connection *conn = &state->connections[sockfd];
+
+  // The rest of the replay of the log is not sent
+  if (conn->history != NULL)
+    end_history(state, sockfd);
+
+  queue_control(state, sockfd, DISCONNECT, NULL, 0);
+
+  // Wait for the frames that are still queued to leave, but not forever
+  struct timeval timeout = {1, 0};
+  setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  int flags = fcntl(sockfd, F_GETFL);
+  fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK);
+  out_queue_flush(&conn->out, sockfd);
+
+  close_connection(state, sockfd);
+}
+
+// Queues the batch of a replay
+// The frames go to the queue directly, even during a replay of the log
+void replay_flush(struct replay *replay)
+{
+  if (replay->batch_len == 0)
+    return;
+
+  out_queue_push(&replay->state->connections[replay->sockfd].out, replay->batch, replay->batch_len);
+  replay->batch_len = 0;
+}
+
+// Adds a frame to the batch of a replay
+void replay_write(struct replay *replay, const void *data, size_t len)
+{
+  if (replay->batch_len + len > REPLAY_BATCH_LEN)
+    replay_flush(replay);
+
+  memcpy(replay->batch + replay->batch_len, data, len);
+  replay->batch_len += len;
+}
+
+// Converts a POST received in v2 to a v1 message
+void post_to_v1(const struct post_view *post, struct tcp_message *message)
+{
+  memset(message, 0, sizeof(struct tcp_message));
+  message->op_code = POST;
+  inet_ntop(AF_INET, &post->udp_client_ip, message->udp_client_ip, INET_ADDRSTRLEN);
+  message->udp_client_port = ntohs(post->udp_client_port);
+  memcpy(message->message.topic, post->topic, post->topic_len);
+  message->message.data_type = post->data_type;
+  memcpy(message->message.content, post->content, post->content_len);
+}
+
+// Queues stored v2 frames as they are, in REPLAY_BATCH_LEN pieces
+void replay_v2(const char *data, size_t len, void *ctx)
+{
+  struct replay *replay = (struct replay *)ctx;
+
+  for (size_t offset = 0; offset < len; offset += REPLAY_BATCH_LEN)
+    replay_write(replay, data + offset, min(len - offset, (size_t)REPLAY_BATCH_LEN));
+}
+
+// Converts stored v2 frames to v1 messages, queued in batches
+void replay_v1(const char *data, size_t len, void *ctx)
+{
+  struct replay *replay = (struct replay *)ctx;
+  size_t offset = 0;
+
+  while (offset < len)
+  {
+    struct frame frame;
+    struct post_view post;
+    ssize_t frame_len = frame_parse(data + offset, len - offset, &frame);
+    if (frame_len <= 0 || !frame_parse_post(&frame, &post))
+      break;
+    offset += frame_len;
+
+    struct tcp_message message;
+    post_to_v1(&post, &message);
+    replay_write(replay, &message, sizeof(struct tcp_message));
+  }
+}
+
+// Queues the messages stored for a client that just reconnected and empties
+// its store
+void replay_store(struct server_state *state, int sockfd, const char *id, struct sf_store *store)
+{
+  lock_guard<mutex> guard(store->lock);
+  if (store->frames == 0 && store->dropped == 0)
+    return;
+
+  if (store->dropped > 0)
+    fprintf(stderr, "Store of client %.*s was full, %zu messages were dropped.\n", MAX_ID_LEN, id, store->dropped);
+
+  struct replay *replay = new struct replay;
+  replay->state = state;
+  replay->sockfd = sockfd;
+  replay->batch_len = 0;
+
+  if (state->connections[sockfd].version == PO_TCP_V2)
+    sf_store_drain(store, replay_v2, replay);
+  else
+    sf_store_drain(store, replay_v1, replay);
+
+  replay_flush(replay);
+  mark_dirty(state, sockfd);
+  delete replay;
+}
+
+// Queues a record of the log if its topic matches the subscription
+void history_visit(uint64_t offset, uint64_t timestamp, const char *data, size_t len, void *ctx)
+{
+  struct history *history = (struct history *)ctx;
+  struct replay *replay = &history->replay;
+
+  struct frame frame;
+  struct post_view post;
+  if (frame_parse(data, len, &frame) != (ssize_t)len || !frame_parse_post(&frame, &post))
+    return;
+
+  struct topic_tokens topic;
+  topic_tokenize(&topic, post.topic, post.topic_len);
+  if (!topic_pattern_match(&history->pattern, &topic))
+    return;
+
+  if (replay->state->connections[replay->sockfd].version == PO_TCP_V2)
+  {
+    replay_write(replay, data, len);
+  }
+  else
+  {
+    struct tcp_message message;
+    post_to_v1(&post, &message);
+    replay_write(replay, &message, sizeof(struct tcp_message));
+  }
+}
+
+// Ends the replay of the log of a connection; the frames that were held
+// during it are queued after it
+void end_history(struct server_state *state, int sockfd)
+{
+  struct connection *conn = &state->connections[sockfd];
+
+  replay_flush(&conn->history->replay);
+  out_queue_splice(&conn->out, &conn->held);
+
+  delete conn->history;
+  conn->history = NULL;
+}
+
+// Queues the next records of the log for a connection that replays it
+void pump_history(struct server_state *state, int sockfd)
+{
+  struct connection *conn = &state->connections[sockfd];
+  struct history *history = conn->history;
+
+  if (topic_log_read(state->broker->log, &history->cursor, history_visit, history))
+    replay_flush(&history->replay);
+  else
+    end_history(state, sockfd);
+}
+
+// Starts the replay of the log for a new subscription, up to end_offset,
+// the first offset that is sent live to the connection
+void start_history(struct server_state *state, int sockfd, const struct topic_pattern *pattern, uint8_t from,
+                   uint64_t value, uint64_t end_offset)
+{
+  struct connection *conn = &state->connections[sockfd];
+
+  if (state->broker->log == NULL)
+  {
+    fprintf(stderr, "The log is disabled, no message to replay.\n");
+    return;
+  }
+
+  if (conn->history != NULL)
+  {
+    fprintf(stderr, "A replay of the log is already in progress.\n");
+    return;
+  }
+
+  struct history *history = new struct history;
+  history->pattern = *pattern;
+  history->replay.state = state;
+  history->replay.sockfd = sockfd;
+  history->replay.batch_len = 0;
+  topic_log_seek(state->broker->log, &history->cursor, from == FROM_OFFSET ? value : 0, from == FROM_TIME ? value : 0,
+                 end_offset);
+
+  // The replay is driven by the flushes of the connection
+  conn->history = history;
+  mark_dirty(state, sockfd);
+}
+
+// Handles the CONNECT message of a new TCP connection
+// Returns false if the connection was closed
+bool handle_connect(struct server_state *state, int sockfd, struct tcp_message *message)
+{
+  struct connection *conn = &state->connections[sockfd];
+
+  // Check that the message is a CONNECT message
+  if (message->op_code != CONNECT)
+  {
+    close_connection(state, sockfd);
+    return false;
+  }
+
+  // The lookup and the registration of the ID are done in one step, so that
+  // two threads can not connect the same ID
+  int found = -1;
+  bool already_connected = false;
+  struct sf_store *store = NULL;
+  {
+    unique_lock<shared_mutex> guard(state->broker->lock);
+    vector<struct tcp_client> &clients = state->broker->clients;
+
+    // Check if the client ID is already in use
+    string id(message->id, strnlen(message->id, MAX_ID_LEN));
+    auto it = state->broker->client_ids.find(id);
+    if (it != state->broker->client_ids.end())
+      found = it->second;
+
+    if (found >= 0 && clients[found].connected)
+    {
+      already_connected = true;
+    }
+    else if (found >= 0)
+    {
+      // RECONNECT THE CLIENT
+
+      // Mark the client as connected again and update its IP, port and socket
+      struct tcp_client *client = &clients[found];
+      client->connected = true;
+      strcpy(client->ip, conn->ip);
+      client->port = conn->port;
+      client->sockfd = sockfd;
+      client->shard = state->shard;
+      client->generation++;
+
+      // No message is stored from now on, the store can be replayed
+      store = client->store;
+    }
+    else
+    {
+      // Create a new client
+      struct tcp_client new_client;
+      strncpy(new_client.id, message->id, MAX_ID_LEN);
+      new_client.connected = true;
+      strcpy(new_client.ip, conn->ip);
+      new_client.port = conn->port;
+      new_client.sockfd = sockfd;
+      new_client.shard = state->shard;
+      new_client.generation = 1;
+      new_client.store = NULL;
+
+      // Add the new client to the list of clients
+      clients.push_back(new_client);
+      found = clients.size() - 1;
+      state->broker->client_ids.emplace(id, found);
+    }
+
+    conn->generation = clients[found].generation;
+  }
+
+  // If the client ID is already in use, print "Client <ID> already in use"
+  if (already_connected)
+  {
+    fprintf(stdout, "Client %.*s already connected.\n", MAX_ID_LEN, message->id);
+
+    // Send a message to the client that the ID is already in use
+    disconnect_connection(state, sockfd);
+    return false;
+  }
+
+  conn->client = found;
+
+  // Send a CONNECT_ACK message to the client, still in v1
+  // A client that asked for v2 gets the magic back and both switch to v2
+  bool wants_v2 = memcmp(message->topic, PO_TCP_V2_MAGIC, sizeof(PO_TCP_V2_MAGIC)) == 0;
+  if (wants_v2)
+    queue_control(state, sockfd, CONNECT_ACK, PO_TCP_V2_MAGIC, sizeof(PO_TCP_V2_MAGIC));
+  else
+    queue_control(state, sockfd, CONNECT_ACK, NULL, 0);
+
+  conn->version = wants_v2 ? PO_TCP_V2 : PO_TCP_V1;
+
+  // Print "New client <ID> connected from <IP>:<PORT>."
+  fprintf(stdout, "New client %.*s connected from %s:%hu.\n", MAX_ID_LEN, message->id, conn->ip, conn->port);
+
+  // Send what was published while the client was offline, before any new
+  // message
+  if (store != NULL)
+    replay_store(state, sockfd, message->id, store);
+  return true;
+}
+
+// Handles a message received from a connected TCP client
+// Could be a DISCONNECT/SUBSCRIBE/SUBSCRIBE_SF/SUBSCRIBE_FROM/UNSUBSCRIBE message
+// Returns false if the connection was closed
+bool handle_client_message(struct server_state *state, int sockfd, uint8_t op_code, const char *topic, size_t topic_len)
+{
+  struct connection *conn = &state->connections[sockfd];
+  struct broker *broker = state->broker;
+
+  // Check the operation code
+  if (op_code == DISCONNECT)
+  {
+    // Mark the client as disconnected, close the socket and print
+    // "Client <ID> disconnected."
+    drop_connection(state, sockfd);
+    return false;
+  }
+  else if (op_code == SUBSCRIBE || op_code == SUBSCRIBE_SF || op_code == SUBSCRIBE_FROM)
+  {
+    // SUBSCRIBE, with store-and-forward or with a replay of the log
+
+    // SUBSCRIBE_FROM starts with where the replay starts
+    uint8_t from = 0;
+    uint64_t from_value = 0;
+    if (op_code == SUBSCRIBE_FROM)
+    {
+      if (topic_len < SUBSCRIBE_FROM_LEN)
       {
-        // If the next token is "+"
+        fprintf(stderr, "Invalid topic.\n");
+        return true;
+      }
 
-        // If the next token is the last token in the first vector, return true
-        if (index_tokens1 == tokens1.size() - 2)
-          return true;
+      from = topic[0];
+      memcpy(&from_value, topic + 1, sizeof(uint64_t));
+      from_value = be64toh(from_value);
+      topic += SUBSCRIBE_FROM_LEN;
+      topic_len -= SUBSCRIBE_FROM_LEN;
+    }
 
-        // Get the next token after the next token after "*"
-        next = tokens1[index_tokens1 + 2];
+    // Compile the pattern once, then add it to the list of topics of the
+    // client and to the index
+    struct topic_pattern pattern;
+    if (!topic_pattern_compile(&pattern, topic, topic_len))
+    {
+      fprintf(stderr, "Invalid topic.\n");
+      return true;
+    }
 
-        // Find the next token in the second vector that is equal to the next token after "*"
-        while (index_tokens2 < tokens2.size() && tokens2[index_tokens2] != next)
-          index_tokens2++;
+    // The messages logged before the subscription are replayed, the others
+    // are matched by it
+    uint64_t end_offset = 0;
+    {
+      unique_lock<shared_mutex> guard(broker->lock);
+      struct tcp_client *client = &broker->clients[conn->client];
+      if (broker->log != NULL)
+        end_offset = topic_log_end(broker->log);
 
-        // If the token is not found, return false
-        if (index_tokens2 == tokens2.size())
-          return false;
+      if (topic_trie_subscribe(&broker->subscriptions, &pattern, conn->client))
+        client->topics_subscribed.insert(pattern.text);
 
-        // Else, continue
-        index_tokens1 += 2;
+      // Subscribing again changes the store-and-forward flag of the topic
+      if (op_code == SUBSCRIBE_SF)
+      {
+        topic_trie_subscribe(&broker->sf_subscriptions, &pattern, conn->client);
+        if (client->store == NULL)
+          client->store = sf_store_new();
       }
       else
       {
-        // The next token is not "+"
+        topic_trie_unsubscribe(&broker->sf_subscriptions, &pattern, conn->client);
+      }
+    }
 
-        // Find the next token in the second vector that is equal to the next token after "*"
-        while (index_tokens2 < tokens2.size() && tokens2[index_tokens2] != next)
-          index_tokens2++;
+    // Send a message to the client that it subscribed to the topic
+    queue_control(state, sockfd, SUBSCRIBE_ACK, pattern.text, pattern.length);
 
-        // If the token is not found, return false
-        if (index_tokens2 == tokens2.size())
-          return false;
+    if (op_code == SUBSCRIBE_FROM)
+      start_history(state, sockfd, &pattern, from, from_value, end_offset);
+  }
+  else if (op_code == UNSUBSCRIBE)
+  {
+    // UNSUBSCRIBE
 
-        // Else, continue
-        index_tokens1++;
-      }
+    // Remove the topic from the list of topics of the client and from the index
+    struct topic_pattern pattern;
+    if (!topic_pattern_compile(&pattern, topic, topic_len))
+    {
+      fprintf(stderr, "Invalid topic.\n");
+      return true;
     }
-    // Else the topics are not matching
-    else
+
     {
-      return false;
+      unique_lock<shared_mutex> guard(broker->lock);
+      if (topic_trie_unsubscribe(&broker->subscriptions, &pattern, conn->client))
+        broker->clients[conn->client].topics_subscribed.erase(pattern.text);
+      topic_trie_unsubscribe(&broker->sf_subscriptions, &pattern, conn->client);
     }
-  }
 
-  // If the tokens are matching, return true
-  if (index_tokens1 == tokens1.size() && index_tokens2 == tokens2.size())
-    return true;
+    // Send a message to the client that it unsubscribed from the topic
+    queue_control(state, sockfd, UNSUBSCRIBE_ACK, pattern.text, pattern.length);
+  }
+  else
+  {
+    // Invalid operation code
+    fprintf(stderr, "Invalid operation code.\n");
+  }
 
-  // Otherwise, there is only a partial match between the topics
-  return false;
+  return true;
 }
 
-void run_app_multi_server(int tcp_sockfd, int udp_sockfd)
+// Handler for the sockets of the TCP clients
+void on_client_event(int sockfd, uint32_t events, void *ctx)
 {
-  // Initialize the vector of clients
-  vector<struct tcp_client> clients;
-  int rc;
+  struct server_state *state = (struct server_state *)ctx;
+  struct connection *conn = &state->connections[sockfd];
+  char buffer[4 * sizeof(struct tcp_message)];
 
-  // Initialize the set of active sockets
-  fd_set fds, tmp_fds;
-  FD_ZERO(&fds);
-  FD_ZERO(&tmp_fds);
+  // The socket can take more of the queued frames
+  if ((events & EPOLLOUT) && !flush_connection(state, sockfd))
+    return;
 
-  // Add the STDIN, TCP and UDP sockets to the set
-  FD_SET(STDIN_FILENO, &fds);
-  FD_SET(tcp_sockfd, &fds);
-  FD_SET(udp_sockfd, &fds);
+  if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    return;
 
-  // Initialize the maximum file descriptor
-  int fdmax = max(tcp_sockfd, udp_sockfd);
-
-  // Run the application
+  // Read everything that is available without blocking
   while (1)
   {
-    tmp_fds = fds;
+    int rc = recv(sockfd, buffer, sizeof(buffer), 0);
+    if (rc < 0 && errno == EINTR)
+      continue;
 
-    // Select the active sockets
-    rc = select(fdmax + 1, &tmp_fds, NULL, NULL, NULL);
-    DIE(rc < 0, "Select ERROR");
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
 
-    // Check if the STDIN is active and an exit command was given
-    if (FD_ISSET(STDIN_FILENO, &tmp_fds))
+    if (rc <= 0)
     {
-      char buffer[BUFLEN];
-      memset(buffer, 0, BUFLEN);
-
-      // Read the command from STDIN
-      rc = read(STDIN_FILENO, buffer, BUFLEN);
-      DIE(rc < 0, "Read from STDIN ERROR");
+      // The client closed the connection without sending DISCONNECT
+      drop_connection(state, sockfd);
+      return;
+    }
 
-      // Check if the command is 'exit'
-      if (strncmp(buffer, "exit", 4) == 0)
-      {
-        // Close all the sockets and send a DISCONNECT message to the clients
-        for (auto client : clients)
-        {
-          // If the client is not connected, continue
-          if (!client.connected)
-            continue;
+    conn->in_buf.append(buffer, rc);
 
-          struct tcp_message message;
-          message.op_code = DISCONNECT;
-          rc = send_all(client.sockfd, &message, sizeof(struct tcp_message));
-          DIE(rc < 0, "Send DISCONNECT message ERROR");
+    // A short read means that the socket was drained
+    if ((size_t)rc < sizeof(buffer))
+      break;
+  }
 
-          close(client.sockfd);
-        }
+  // Handle all the whole messages that were received
+  size_t offset = 0;
+  while (offset < conn->in_buf.size())
+  {
+    const char *data = conn->in_buf.data() + offset;
+    size_t available = conn->in_buf.size() - offset;
+    bool still_open;
 
+    if (conn->version == PO_TCP_V1)
+    {
+      // v1 messages (and every CONNECT) have a fixed size
+      if (available < sizeof(struct tcp_message))
         break;
+
+      struct tcp_message message;
+      memcpy(&message, data, sizeof(struct tcp_message));
+      offset += sizeof(struct tcp_message);
+
+      if (conn->client < 0)
+      {
+        still_open = handle_connect(state, sockfd, &message);
+      }
+      else if (message.op_code == SUBSCRIBE_FROM)
+      {
+        // Same body as in v2, from the fields of the message
+        char body[SUBSCRIBE_FROM_LEN + MAX_TOPIC_LEN];
+        size_t topic_len = strnlen(message.topic, MAX_TOPIC_LEN);
+        body[0] = message.message.data_type;
+        memcpy(body + 1, message.message.content, sizeof(uint64_t));
+        memcpy(body + SUBSCRIBE_FROM_LEN, message.topic, topic_len);
+        still_open = handle_client_message(state, sockfd, message.op_code, body, SUBSCRIBE_FROM_LEN + topic_len);
       }
       else
       {
-        fprintf(stderr, "Invalid command.\n");
+        still_open = handle_client_message(state, sockfd, message.op_code, message.topic, strnlen(message.topic, MAX_TOPIC_LEN));
+      }
+    }
+    else
+    {
+      // v2 frames carry their length
+      struct frame frame;
+      ssize_t len = frame_parse(data, available, &frame);
+      if (len == 0)
+        break;
+
+      if (len < 0)
+      {
+        fprintf(stderr, "Invalid frame.\n");
+        drop_connection(state, sockfd);
+        return;
       }
+
+      offset += len;
+      still_open = handle_client_message(state, sockfd, frame.op_code, frame.body, frame.body_len);
     }
 
-    // Check if any other socket is active
-    for (int i = 1; i <= fdmax; i++)
+    if (!still_open)
+      return;
+  }
+
+  conn->in_buf.erase(0, offset);
+}
+
+// Handler for the listening TCP socket
+void on_accept_event(int tcp_sockfd, uint32_t events, void *ctx)
+{
+  struct server_state *state = (struct server_state *)ctx;
+
+  // Accept all the pending connections
+  while (1)
+  {
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    int newsockfd = accept4(tcp_sockfd, (struct sockaddr *)&client_addr, &client_len, SOCK_NONBLOCK);
+    if (newsockfd < 0)
     {
-      // If the socket is not active, continue
-      if (!FD_ISSET(i, &tmp_fds))
+      if (errno == EINTR || errno == ECONNABORTED)
         continue;
 
-      // Check the type of the socket
-      if (i == tcp_sockfd)
+      // Out of descriptors, keep the connection in the backlog for later
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("Accept TCP connection ERROR");
+      break;
+    }
+
+    // Set NO_DELAY option
+    int flag = 1;
+    setsockopt(newsockfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+
+    // Remember the client IP and port until the CONNECT message arrives
+    if ((size_t)newsockfd >= state->connections.size())
+      state->connections.resize(newsockfd + 1);
+
+    struct connection *conn = &state->connections[newsockfd];
+    conn->open = true;
+    conn->client = -1;
+    conn->generation = 0;
+    conn->version = PO_TCP_V1;
+    inet_ntop(AF_INET, &client_addr.sin_addr, conn->ip, INET_ADDRSTRLEN);
+    conn->port = ntohs(client_addr.sin_port);
+    conn->in_buf.clear();
+    out_queue_init(&conn->out);
+    conn->dirty = false;
+    conn->writing = false;
+    conn->reported_bytes = 0;
+    conn->history = NULL;
+    out_queue_init(&conn->held);
+    stat_add(state->stats.connections, 1);
+
+    // The CONNECT message is handled when it is received, without blocking
+    int rc = reactor_add(&state->reactor, newsockfd, EPOLLIN, on_client_event, state);
+    DIE(rc < 0, "Add TCP client to epoll ERROR");
+  }
+}
+
+// Queues a POST for the subscribers owned by this thread
+// The message is encoded at most once for each protocol version, and every
+// subscriber's queue references the same frame
+void deliver_post(struct server_state *state, const struct udp_message *message, size_t content_len,
+                  const struct sockaddr_in *udp_client_addr, const vector<struct post_target> &targets,
+                  uint64_t received_at)
+{
+  struct shared_frame *post_v2 = NULL;
+  struct shared_frame *post_v1 = NULL;
+  uint64_t start = stats_now();
+  size_t delivered = 0;
+
+  for (const struct post_target &target : targets)
+  {
+    // The client may have left since it was matched, and its socket may
+    // belong to another session now
+    struct connection *conn = &state->connections[target.sockfd];
+    if (!conn->open || conn->client != target.client || conn->generation != target.generation)
+      continue;
+
+    // Send the message to the TCP client
+    if (conn->version == PO_TCP_V2)
+    {
+      // Only the meaningful bytes of the content are sent
+      if (post_v2 == NULL)
       {
-        // Accept the new TCP connection
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int newsockfd = accept(tcp_sockfd, (struct sockaddr *)&client_addr, &client_len);
-        DIE(newsockfd < 0, "Accept TCP connection ERROR");
-
-        // Get the client IP and port
-        char tcp_client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, tcp_client_ip, INET_ADDRSTRLEN);
-        uint16_t tcp_client_port = ntohs(client_addr.sin_port);
-
-        // Get the client ID by reading from the socket an message
-        struct tcp_message *message = (struct tcp_message *)malloc(sizeof(struct tcp_message));
-        rc = recv_all(newsockfd, message, sizeof(struct tcp_message));
-        DIE(rc < 0, "Receive client ID ERROR");
-
-        // Check that the message is a CONNECT message
-        if (message->op_code != CONNECT)
-        {
-          close(newsockfd);
-          continue;
-        }
-
-        // Check if the client ID is already in use
-        bool found = false;
-        struct tcp_client *client_found = NULL;
-        for (auto client : clients)
-        {
-          if (strcmp(client.id, message->id) == 0)
-          {
-            found = true;
-            client_found = &client;
-            break;
-          }
-        }
-
-        // If the client ID is already in use, print "Client <ID> already in use"
-        if (found && client_found->connected)
-        {
-          fprintf(stdout, "Client %s already connected.\n", message->id);
-
-          // Send a message to the client that the ID is already in use
-          struct tcp_message response;
-          response.op_code = DISCONNECT;
-          rc = send_all(newsockfd, &response, sizeof(struct tcp_message));
-          DIE(rc < 0, "Send DISCONNECT message ERROR");
-
-          close(newsockfd);
-          continue;
-        }
-        else if (found)
-        {
-          // RECONNECT THE CLIENT
-
-          // Mark the client as connected again
-          for (auto &client : clients)
-          {
-            if (strcmp(client.id, message->id) == 0)
-            {
-              client.connected = true;
-              break;
-            }
-          }
-
-          // Update the client's IP and port
-          strcpy(client_found->ip, tcp_client_ip);
-          client_found->port = tcp_client_port;
-
-          // Update the client's socket
-          client_found->sockfd = newsockfd;
-        }
-        else
-        {
-          // Create a new client
-          struct tcp_client new_client;
-          strncpy(new_client.id, message->id, MAX_ID_LEN);
-          new_client.connected = true;
-          strcpy(new_client.ip, tcp_client_ip);
-          new_client.port = tcp_client_port;
-          new_client.sockfd = newsockfd;
-
-          // Add the new client to the list of clients
-          clients.push_back(new_client);
-        }
-
-        // Set NO_DELAY option
-        int flag = 1;
-        rc = setsockopt(newsockfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
-
-        // Add the new socket to the set
-        FD_SET(newsockfd, &fds);
-        fdmax = max(fdmax, newsockfd);
-
-        // Send a CONNECT_ACK message to the client
-        struct tcp_message response;
-        response.op_code = CONNECT_ACK;
-        rc = send_all(newsockfd, &response, sizeof(struct tcp_message));
-        DIE(rc < 0, "Send CONNECT_ACK message ERROR");
-
-        // Print "New client <ID> connected from <IP>:<PORT>."
-        fprintf(stdout, "New client %s connected from %s:%hu.\n", message->id, tcp_client_ip, tcp_client_port);
+        char buffer[MAX_POST_FRAME_LEN];
+        size_t len = frame_build_post(buffer, message, content_len, udp_client_addr->sin_addr.s_addr, udp_client_addr->sin_port);
+        post_v2 = shared_frame_new(buffer, len);
       }
-      else if (i == udp_sockfd)
+
+      queue_shared_frame(state, target.sockfd, post_v2);
+    }
+    else
+    {
+      if (post_v1 == NULL)
       {
-        // Declare a udp_message to receive the message from the UDP client
-        struct udp_message *message = (struct udp_message *)malloc(sizeof(struct udp_message));
-        memset(message, 0, sizeof(struct udp_message));
-
-        // Declare a sockaddr_in to receive the address of the UDP client
-        struct sockaddr_in udp_client_addr;
-        socklen_t udp_client_len = sizeof(udp_client_addr);
-
-        // Receive the message from the UDP client
-        rc = recvfrom(udp_sockfd, message, sizeof(struct udp_message), 0, (struct sockaddr *)&udp_client_addr, &udp_client_len);
-        DIE(rc < 0, "Receive message from UDP client ERROR");
-
-        // Get the UDP client IP and port
-        char udp_client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &udp_client_addr.sin_addr, udp_client_ip, INET_ADDRSTRLEN);
-        uint16_t udp_client_port = ntohs(udp_client_addr.sin_port);
-
-        // Find the clients that are subscribed to a matching topic
-        for (auto client : clients)
-        {
-          if (!client.connected)
-            continue;
-
-          for (auto topic : client.topics_subscribed)
-          {
-            if (topics_are_matching(topic.c_str(), message->topic))
-            {
-              // Send the message to the TCP client
-              struct tcp_message response;
-              response.op_code = POST;
-              strcpy(response.udp_client_ip, udp_client_ip);
-              response.udp_client_port = udp_client_port;
-              memcpy(&response.message, message, sizeof(struct udp_message));
-              rc = send_all(client.sockfd, &response, sizeof(struct tcp_message));
-              DIE(rc < 0, "Send POST message ERROR");
-
-              // Send a message only one time to a client
-              break;
-            }
-          }
-        }
+        // Built in place, the message is copied only this one time
+        post_v1 = shared_frame_alloc(sizeof(struct tcp_message));
+        struct tcp_message *post = (struct tcp_message *)shared_frame_data(post_v1);
+        memset(post, 0, sizeof(struct tcp_message));
+        post->op_code = POST;
+        inet_ntop(AF_INET, &udp_client_addr->sin_addr, post->udp_client_ip, INET_ADDRSTRLEN);
+        post->udp_client_port = ntohs(udp_client_addr->sin_port);
+        memcpy(&post->message, message, sizeof(struct udp_message));
       }
-      else
+
+      queue_shared_frame(state, target.sockfd, post_v1);
+    }
+
+    delivered++;
+  }
+
+  if (delivered > 0)
+  {
+    // The wakeup is timed from its oldest datagram
+    if (state->oldest_queued == 0 || received_at < state->oldest_queued)
+      state->oldest_queued = received_at;
+
+    stat_add(state->stats.deliveries, delivered);
+    stat_record_since(&state->stats, STAGE_ENQUEUE, start);
+  }
+
+  // The queues hold their own references
+  if (post_v2 != NULL)
+    shared_frame_unref(post_v2);
+  if (post_v1 != NULL)
+    shared_frame_unref(post_v1);
+}
+
+// Wakes a reactor thread, unless a wakeup is already pending
+void wake_shard(struct server_state *shard)
+{
+  if (shard->inbox_signalled.exchange(true))
+    return;
+
+  uint64_t one = 1;
+  int rc = write(shard->inbox_fd, &one, sizeof(one));
+  DIE(rc < 0 && errno != EAGAIN, "Write eventfd ERROR");
+}
+
+// Handler for the eventfd of the inbox: sends the POSTs routed by the other
+// threads, in the order each thread routed them
+void on_inbox_event(int fd, uint32_t events, void *ctx)
+{
+  struct server_state *state = (struct server_state *)ctx;
+
+  uint64_t count;
+  int rc = read(fd, &count, sizeof(count));
+  DIE(rc < 0 && errno != EAGAIN, "Read eventfd ERROR");
+
+  // A push that happens from now on wakes the thread again
+  state->inbox_signalled.store(false);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  struct mpsc_node *node;
+  while ((node = mpsc_queue_pop(&state->inbox)) != NULL)
+  {
+    struct routed_post *post = (struct routed_post *)node;
+    stat_add(state->stats.routed_in, 1);
+    deliver_post(state, &post->message, post->content_len, &post->udp_client_addr, post->targets, post->received_at);
+    delete post;
+  }
+}
+
+// Stores a message for the offline clients with a store-and-forward
+// subscription matching its topic
+// The caller holds the shared lock of the broker
+void store_post(struct server_state *state, const struct udp_message *message, const struct topic_tokens *topic,
+                size_t content_len, const struct sockaddr_in *udp_client_addr)
+{
+  struct broker *broker = state->broker;
+  topic_trie_match(&broker->sf_subscriptions, &state->matcher, topic, state->sf_matched);
+
+  char post[MAX_POST_FRAME_LEN];
+  size_t post_len = 0;
+
+  for (int index : state->sf_matched)
+  {
+    struct tcp_client *client = &broker->clients[index];
+    if (client->connected)
+      continue;
+
+    // Stored in the v2 encoding, converted when replayed to a v1 client
+    if (post_len == 0)
+      post_len = frame_build_post(post, message, content_len, udp_client_addr->sin_addr.s_addr, udp_client_addr->sin_port);
+
+    // Other threads may store in the same client at the same time
+    lock_guard<mutex> guard(client->store->lock);
+    if (!sf_store_append(client->store, broker->spill_dir, post, post_len) && client->store->dropped == 1)
+      fprintf(stderr, "Store of client %.*s is full, dropping messages.\n", MAX_ID_LEN, client->id);
+  }
+}
+
+// Routes one UDP message to the subscribers of its topic
+void handle_datagram(struct server_state *state, const struct udp_message *message, size_t len,
+                     const struct sockaddr_in *udp_client_addr, uint64_t received_at)
+{
+  struct broker *broker = state->broker;
+  uint64_t start = stats_now();
+  stat_add(state->stats.datagram_bytes, len);
+
+  // Split the topic once, without copying it
+  // The topic fills the whole field when it has MAX_TOPIC_LEN characters
+  struct topic_tokens topic;
+  topic_tokenize(&topic, message->topic, MAX_TOPIC_LEN);
+
+  size_t header_len = MAX_TOPIC_LEN + sizeof(uint8_t);
+  size_t content_len = udp_content_len(message, len > header_len ? len - header_len : 0);
+
+  // Find the clients that are subscribed to a matching topic and sort them
+  // by the thread that owns their connection
+  // Every client is found only one time, even if several topics match
+  {
+    shared_lock<shared_mutex> guard(broker->lock);
+    topic_trie_match(&broker->subscriptions, &state->matcher, &topic, state->matched);
+
+    bool offline = false;
+    for (int index : state->matched)
+    {
+      const struct tcp_client *client = &broker->clients[index];
+      if (!client->connected)
       {
-        // Receive a message from an TCP client
-        // Could be a DISCONNECT/SUBSCRIBE/UNSUBSCRIBE message
-
-        // Receive the message from the client
-        struct tcp_message *message = (struct tcp_message *)malloc(sizeof(struct tcp_message));
-        rc = recv_all(i, message, sizeof(struct tcp_message));
-        DIE(rc < 0, "Receive message from client ERROR");
-
-        // Check the operation code
-        if (message->op_code == DISCONNECT)
-        {
-          // Mark the client as disconnected
-          for (auto &client : clients)
-          {
-            if (strcmp(client.id, message->id) == 0)
-            {
-              client.connected = false;
-              break;
-            }
-          }
-
-          // Remove the client's socket from the set
-          FD_CLR(i, &fds);
-
-          // Close the socket
-          close(i);
-
-          // Print "Client <ID> disconnected."
-          fprintf(stdout, "Client %s disconnected.\n", message->id);
-        }
-        else if (message->op_code == SUBSCRIBE)
-        {
-          // SUBSCRIBE
-
-          // Add the topic to the list of topics of the client
-          for (auto &client : clients)
-          {
-            if (strncmp(client.id, message->id, MAX_ID_LEN) == 0)
-            {
-              string topic(message->topic, MAX_TOPIC_LEN);
-              client.topics_subscribed.push_back(topic);
-              break;
-            }
-          }
-
-          // Send a message to the client that it subscribed to the topic
-          struct tcp_message response;
-          response.op_code = SUBSCRIBE_ACK;
-          strncpy(response.topic, message->topic, MAX_TOPIC_LEN);
-          rc = send_all(i, &response, sizeof(struct tcp_message));
-          DIE(rc < 0, "Send SUBSCRIBE_ACK message ERROR");
-        }
-        else if (message->op_code == UNSUBSCRIBE)
-        {
-          // UNSUBSCRIBE
-
-          // Remove the topic from the list of topics of the client
-          for (auto &client : clients)
-          {
-            if (strcmp(client.id, message->id) == 0)
-            {
-              string topic(message->topic, MAX_TOPIC_LEN);
-              client.topics_subscribed.erase(remove(client.topics_subscribed.begin(), client.topics_subscribed.end(), topic), client.topics_subscribed.end());
-              break;
-            }
-          }
-
-          // Send a message to the client that it unsubscribed from the topic
-          struct tcp_message response;
-          response.op_code = UNSUBSCRIBE_ACK;
-          strncpy(response.topic, message->topic, MAX_TOPIC_LEN);
-          rc = send_all(i, &response, sizeof(struct tcp_message));
-          DIE(rc < 0, "Send UNSUBSCRIBE_ACK message ERROR");
-        }
-        else
-        {
-          // Invalid operation code
-          fprintf(stderr, "Invalid operation code.\n");
-        }
+        offline = true;
+        continue;
       }
+
+      struct post_target target = {index, client->sockfd, client->generation};
+      if (client->shard == state->shard)
+      {
+        state->local.push_back(target);
+        continue;
+      }
+
+      struct routed_post *&post = state->outgoing[client->shard];
+      if (post == NULL)
+        post = new routed_post;
+      post->targets.push_back(target);
     }
+
+    // Keep the message for the offline clients that subscribed to it with
+    // store-and-forward
+    if (offline && broker->sf_subscriptions.subscriptions > 0)
+      store_post(state, message, &topic, content_len, udp_client_addr);
+
+    // Logged under the lock, so a SUBSCRIBE_FROM either replays the message
+    // or matched it above
+    if (broker->log != NULL)
+    {
+      char post[MAX_POST_FRAME_LEN];
+      size_t post_len = frame_build_post(post, message, content_len, udp_client_addr->sin_addr.s_addr,
+                                         udp_client_addr->sin_port);
+      topic_log_append(broker->log, post, post_len);
+    }
+  }
+
+  stat_add(state->stats.matched, state->matched.size());
+  stat_record(&state->stats.fanout, state->matched.size());
+  stat_record_since(&state->stats, STAGE_MATCH, start);
+
+  deliver_post(state, message, content_len, udp_client_addr, state->local, received_at);
+  state->local.clear();
+
+  // Hand the message to the threads that own the other subscribers
+  for (size_t shard = 0; shard < state->outgoing.size(); shard++)
+  {
+    struct routed_post *post = state->outgoing[shard];
+    if (post == NULL)
+      continue;
+
+    memcpy(&post->message, message, sizeof(struct udp_message));
+    post->content_len = content_len;
+    post->udp_client_addr = *udp_client_addr;
+    post->received_at = received_at;
+    stat_add(state->stats.routed_out, 1);
+
+    mpsc_queue_push(&broker->shards[shard]->inbox, &post->node);
+    wake_shard(broker->shards[shard]);
+    state->outgoing[shard] = NULL;
   }
+}
 
-  return;
+// Reports the datagrams dropped by the kernel since the last report, at most
+// once per second
+void report_udp_drops(struct server_state *state)
+{
+  uint32_t drops = state->udp_pool.drops;
+  state->stats.udp_drops.store(drops, memory_order_relaxed);
+  if (drops == state->reported_drops)
+    return;
+
+  time_t now = time(NULL);
+  if (now == state->drops_reported_at)
+    return;
+
+  fprintf(stderr, "UDP receive queue full: %u datagrams dropped (%u in total).\n", drops - state->reported_drops, drops);
+  state->reported_drops = drops;
+  state->drops_reported_at = now;
 }
 
-int main(int argc, char *argv[])
+// Handler for the UDP socket
+void on_udp_event(int udp_sockfd, uint32_t events, void *ctx)
 {
-  // Disable buffering for stdout
-  setvbuf(stdout, NULL, _IONBF, BUFSIZ);
+  struct server_state *state = (struct server_state *)ctx;
+  struct datagram_pool *pool = &state->udp_pool;
 
-  // Check if the number of arguments is valid
-  if (argc != 2)
+  // In edge-triggered mode the socket has to be drained
+  int budget = state->reactor.edge_triggered ? -1 : UDP_READ_BUDGET;
+
+  while (budget != 0)
   {
-    printf("\n Usage: ./server <port>\n");
-    return 1;
+    // Receive a batch of messages from the UDP clients
+    uint64_t start = stats_now();
+    int count = datagram_pool_recv(pool, udp_sockfd, budget > 0 ? budget : DATAGRAM_BATCH);
+    DIE(count < 0, "Receive message from UDP client ERROR");
+
+    if (count > 0)
+    {
+      stat_add(state->stats.datagrams, count);
+      stat_record_since(&state->stats, STAGE_INGEST, start);
+    }
+
+    uint64_t received_at = stats_now();
+    for (int i = 0; i < count; i++)
+      handle_datagram(state, &pool->messages[i], pool->headers[i].msg_len, &pool->addrs[i], received_at);
+
+    if (budget > 0)
+      budget -= count;
+
+    // A short batch means that the socket was drained
+    if (count < DATAGRAM_BATCH)
+      break;
   }
 
-  // Parse the port
-  uint16_t port;
-  int rc = sscanf(argv[1], "%hu", &port);
-  DIE(rc != 1 || port < 1024, "Given port is invalid");
+  report_udp_drops(state);
+}
 
-  // Initialize server address
-  struct sockaddr_in server_addr;
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(port);
-  server_addr.sin_addr.s_addr = INADDR_ANY;
+// Statistics of all the reactor threads
+vector<struct shard_stats *> broker_stats(struct broker *broker)
+{
+  vector<struct shard_stats *> stats;
+  for (struct server_state *shard : broker->shards)
+    stats.push_back(&shard->stats);
+  return stats;
+}
+
+// Handler for the statistics socket: every connection gets the JSON dump
+// and is closed
+void on_stats_event(int fd, uint32_t events, void *ctx)
+{
+  struct server_state *state = (struct server_state *)ctx;
+
+  while (1)
+  {
+    int clientfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK);
+    if (clientfd < 0)
+      break;
+
+    // The dump fits in the socket buffer, a reader that is not there loses it
+    string json = stats_json(broker_stats(state->broker));
+    send(clientfd, json.data(), json.size(), MSG_NOSIGNAL);
+    close(clientfd);
+  }
+}
+
+// Handler for the STDIN
+void on_stdin_event(int fd, uint32_t events, void *ctx)
+{
+  struct server_state *state = (struct server_state *)ctx;
+  char buffer[BUFLEN];
+  memset(buffer, 0, BUFLEN);
+
+  // Read the command from STDIN
+  int rc = read(STDIN_FILENO, buffer, BUFLEN);
+  DIE(rc < 0, "Read from STDIN ERROR");
+
+  // STDIN was closed, stop watching it
+  if (rc == 0)
+  {
+    reactor_remove(&state->reactor, STDIN_FILENO);
+    return;
+  }
 
+  // Check if the command is 'exit'
+  if (strncmp(buffer, "exit", 4) == 0)
+  {
+    // Every thread disconnects its clients when it leaves its loop
+    state->broker->running = false;
+    for (struct server_state *shard : state->broker->shards)
+      if (shard != state)
+        wake_shard(shard);
+  }
+  else if (strncmp(buffer, "stats", 5) == 0)
+  {
+    stats_print(broker_stats(state->broker), stdout);
+  }
+  else
+  {
+    fprintf(stderr, "Invalid command.\n");
+  }
+}
+
+// Runs the event loop of one reactor thread
+void run_shard(struct server_state *state)
+{
+  struct broker *broker = state->broker;
+  int rc;
+
+  while (broker->running)
+  {
+    rc = reactor_poll(&state->reactor, -1);
+    DIE(rc < 0, "epoll_wait ERROR");
+
+    // Send what the handlers queued, one writev per client
+    if (!state->dirty.empty())
+    {
+      uint64_t start = stats_now();
+      flush_dirty_connections(state);
+      stat_record_since(&state->stats, STAGE_SEND, start);
+    }
+
+    if (state->oldest_queued != 0)
+    {
+      stat_record_since(&state->stats, STAGE_TOTAL, state->oldest_queued);
+      state->oldest_queued = 0;
+    }
+  }
+
+  // Close all the sockets and send a DISCONNECT message to the clients
+  for (size_t sockfd = 0; sockfd < state->connections.size(); sockfd++)
+  {
+    struct connection *conn = &state->connections[sockfd];
+
+    // If the client is not connected, continue
+    if (!conn->open || conn->client < 0)
+      continue;
+
+    disconnect_connection(state, sockfd);
+  }
+}
+
+// Creates the state of a reactor thread and registers its sockets
+// STDIN is watched by the first thread only
+struct server_state *init_shard(struct broker *broker, int shard, int tcp_sockfd, int udp_sockfd, bool edge_triggered)
+{
+  struct server_state *state = new server_state;
+  state->broker = broker;
+  state->shard = shard;
+  state->tcp_sockfd = tcp_sockfd;
+  state->udp_sockfd = udp_sockfd;
+  state->outgoing.assign(broker->shards.size(), NULL);
+  trie_matcher_init(&state->matcher);
+  datagram_pool_init(&state->udp_pool);
+  state->reported_drops = 0;
+  state->drops_reported_at = 0;
+  shard_stats_init(&state->stats);
+  state->oldest_queued = 0;
+
+  int rc = reactor_init(&state->reactor, edge_triggered, MAX_EVENTS);
+  DIE(rc < 0, "epoll_create ERROR");
+
+  mpsc_queue_init(&state->inbox);
+  state->inbox_signalled = false;
+  state->inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  DIE(state->inbox_fd < 0, "eventfd ERROR");
+
+  // Accept and receive without blocking, the handlers drain the sockets
+  rc = fcntl(tcp_sockfd, F_SETFL, fcntl(tcp_sockfd, F_GETFL) | O_NONBLOCK);
+  DIE(rc < 0, "fcntl -- O_NONBLOCK ERROR");
+
+  // Add the STDIN, TCP and UDP sockets and the inbox to the reactor
+  // STDIN can not be watched if it is a regular file
+  if (shard == 0)
+  {
+    rc = reactor_add(&state->reactor, STDIN_FILENO, EPOLLIN, on_stdin_event, state);
+    DIE(rc < 0 && errno != EPERM, "Add STDIN to epoll ERROR");
+
+    if (broker->stats_fd >= 0)
+    {
+      rc = reactor_add(&state->reactor, broker->stats_fd, EPOLLIN, on_stats_event, state);
+      DIE(rc < 0, "Add statistics socket to epoll ERROR");
+    }
+  }
+
+  rc = reactor_add(&state->reactor, tcp_sockfd, EPOLLIN, on_accept_event, state);
+  DIE(rc < 0, "Add TCP socket to epoll ERROR");
+
+  rc = reactor_add(&state->reactor, udp_sockfd, EPOLLIN, on_udp_event, state);
+  DIE(rc < 0, "Add UDP socket to epoll ERROR");
+
+  rc = reactor_add(&state->reactor, state->inbox_fd, EPOLLIN, on_inbox_event, state);
+  DIE(rc < 0, "Add eventfd to epoll ERROR");
+
+  return state;
+}
+
+void free_shard(struct server_state *state)
+{
+  // Drop the POSTs that were routed after the clients were disconnected
+  struct mpsc_node *node;
+  while ((node = mpsc_queue_pop(&state->inbox)) != NULL)
+    delete (struct routed_post *)node;
+
+  reactor_close(&state->reactor);
+  close(state->inbox_fd);
+  delete state;
+}
+
+// Runs one reactor thread per pair of sockets; the first one runs on the
+// calling thread
+void run_app_multi_server(const vector<int> &tcp_sockfds, const vector<int> &udp_sockfds, bool edge_triggered, const char *spill_dir,
+                          const char *log_dir, int stats_fd)
+{
+  struct broker broker;
+  broker.running = true;
+  broker.spill_dir = spill_dir;
+  broker.stats_fd = stats_fd;
+  broker.log = NULL;
+  if (log_dir != NULL)
+  {
+    broker.log = topic_log_open(log_dir);
+    DIE(broker.log == NULL, "topic_log_open");
+  }
+  topic_trie_init(&broker.subscriptions);
+  topic_trie_init(&broker.sf_subscriptions);
+
+  // Every thread needs to know all the others before it starts routing
+  broker.shards.assign(tcp_sockfds.size(), NULL);
+  for (size_t i = 0; i < tcp_sockfds.size(); i++)
+    broker.shards[i] = init_shard(&broker, i, tcp_sockfds[i], udp_sockfds[i], edge_triggered);
+
+  // Run the application
+  vector<thread> threads;
+  for (size_t i = 1; i < broker.shards.size(); i++)
+    threads.emplace_back(run_shard, broker.shards[i]);
+
+  run_shard(broker.shards[0]);
+
+  for (thread &t : threads)
+    t.join();
+
+  for (struct server_state *shard : broker.shards)
+    free_shard(shard);
+
+  for (struct tcp_client &client : broker.clients)
+    if (client.store != NULL)
+      sf_store_free(client.store);
+
+  topic_trie_free(&broker.subscriptions);
+  topic_trie_free(&broker.sf_subscriptions);
+
+  if (broker.log != NULL)
+    topic_log_close(broker.log);
+}
+
+// Opens the Unix socket the statistics are read from
+int open_stats_socket(const char *path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  DIE(strlen(path) >= sizeof(addr.sun_path), "Statistics socket path is too long");
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  DIE(fd < 0, "Statistics socket ERROR");
+
+  // A socket left by a previous run is replaced
+  unlink(path);
+  int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  DIE(rc < 0, "Bind statistics socket ERROR");
+
+  rc = listen(fd, SOMAXCONN);
+  DIE(rc < 0, "Listen statistics socket ERROR");
+
+  return fd;
+}
+
+// Raises the limit of open files so that the server can keep many clients
+void raise_open_files_limit()
+{
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+    return;
+
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+// Creates the TCP and UDP sockets of a reactor thread, bound to server_addr
+// With reuse_port, several threads bind the same port and the kernel spreads
+// the connections and the datagrams between them
+// rcvbuf is the size of the receive buffer of the UDP socket, 0 for the default
+void open_server_sockets(const struct sockaddr_in *server_addr, bool reuse_port, int rcvbuf, int *tcp_sockfd, int *udp_sockfd)
+{
   // Create udp datagrams socket
-  int udp_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-  DIE(udp_sockfd < 0, "UDP socket ERROR");
+  *udp_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  DIE(*udp_sockfd < 0, "UDP socket ERROR");
 
   // Create tcp connections socket
-  int tcp_sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  DIE(tcp_sockfd < 0, "TCP socket ERROR");
+  *tcp_sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  DIE(*tcp_sockfd < 0, "TCP socket ERROR");
 
   // Disable Nagle's algorithm
   int flag = 1;
-  rc = setsockopt(tcp_sockfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+  int rc = setsockopt(*tcp_sockfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
   DIE(rc < 0, "Setsockopt -- TCP_NODELAY ERROR");
 
   // Enable the socket to reuse the address
   const int enable = 1;
-  rc = setsockopt(tcp_sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+  rc = setsockopt(*tcp_sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
   DIE(rc < 0, "setsockopt -- TCP_REUSEADDR ERROR");
 
-  rc = setsockopt(udp_sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+  rc = setsockopt(*udp_sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
   DIE(rc < 0, "setsockopt -- UDP_REUSEADDR ERROR");
 
+  // Count the datagrams dropped because the receive queue is full
+  rc = setsockopt(*udp_sockfd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(int));
+  DIE(rc < 0, "setsockopt -- SO_RXQ_OVFL ERROR");
+
+  if (rcvbuf > 0)
+  {
+    // SO_RCVBUF is capped by net.core.rmem_max; SO_RCVBUFFORCE is not, but
+    // needs CAP_NET_ADMIN
+    if (setsockopt(*udp_sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(int)) < 0)
+    {
+      rc = setsockopt(*udp_sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int));
+      DIE(rc < 0, "setsockopt -- SO_RCVBUF ERROR");
+    }
+
+    // The kernel doubles the value to account for its bookkeeping
+    int actual;
+    socklen_t actual_len = sizeof(actual);
+    rc = getsockopt(*udp_sockfd, SOL_SOCKET, SO_RCVBUF, &actual, &actual_len);
+    if (rc == 0 && actual / 2 < rcvbuf)
+      fprintf(stderr, "UDP receive buffer limited to %d bytes.\n", actual / 2);
+  }
+
+  if (reuse_port)
+  {
+    rc = setsockopt(*tcp_sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int));
+    DIE(rc < 0, "setsockopt -- TCP_REUSEPORT ERROR");
+
+    rc = setsockopt(*udp_sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int));
+    DIE(rc < 0, "setsockopt -- UDP_REUSEPORT ERROR");
+  }
+
   // Bind the socket with the server address
-  rc = bind(tcp_sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr));
+  rc = bind(*tcp_sockfd, (struct sockaddr *)server_addr, sizeof(*server_addr));
   DIE(rc < 0, "TCP bind ERROR");
 
-  rc = bind(udp_sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr));
+  rc = bind(*udp_sockfd, (struct sockaddr *)server_addr, sizeof(*server_addr));
   DIE(rc < 0, "UDP bind ERROR");
 
   // Listen for incoming TCP connections
-  rc = listen(tcp_sockfd, SOMAXCONN);
+  rc = listen(*tcp_sockfd, SOMAXCONN);
   DIE(rc < 0, "TCP listen ERROR");
+}
+
+int main(int argc, char *argv[])
+{
+  // Disable buffering for stdout
+  setvbuf(stdout, NULL, _IONBF, BUFSIZ);
+
+  // Check if the number of arguments is valid
+  if (argc < 2)
+  {
+    printf("\n Usage: ./server <port> [--edge-triggered] [--threads N] [--rcvbuf BYTES] [--spill-dir DIR] [--log-dir DIR]\n"
+           "        [--stats-socket PATH]\n");
+    return 1;
+  }
+
+  // Parse the port
+  uint16_t port;
+  int rc = sscanf(argv[1], "%hu", &port);
+  DIE(rc != 1 || port < 1024, "Given port is invalid");
+
+  // Parse the options
+  bool edge_triggered = false;
+  int threads = 1;
+  int rcvbuf = 0;
+  const char *spill_dir = "/tmp";
+  const char *log_dir = NULL;
+  const char *stats_path = NULL;
+  for (int i = 2; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--edge-triggered") == 0)
+      edge_triggered = true;
+    else if (strcmp(argv[i], "--level-triggered") == 0)
+      edge_triggered = false;
+    else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc && sscanf(argv[i + 1], "%d", &threads) == 1 &&
+             threads >= 1 && threads <= MAX_THREADS)
+      i++;
+    else if (strcmp(argv[i], "--rcvbuf") == 0 && i + 1 < argc && sscanf(argv[i + 1], "%d", &rcvbuf) == 1 && rcvbuf > 0)
+      i++;
+    else if (strcmp(argv[i], "--spill-dir") == 0 && i + 1 < argc)
+      spill_dir = argv[++i];
+    else if (strcmp(argv[i], "--log-dir") == 0 && i + 1 < argc)
+      log_dir = argv[++i];
+    else if (strcmp(argv[i], "--stats-socket") == 0 && i + 1 < argc)
+      stats_path = argv[++i];
+    else
+    {
+      printf("\n Usage: ./server <port> [--edge-triggered] [--threads N] [--rcvbuf BYTES] [--spill-dir DIR] [--log-dir DIR]\n"
+           "        [--stats-socket PATH]\n");
+      return 1;
+    }
+  }
+
+  raise_open_files_limit();
+  stats_init();
+
+  // A client that goes away while frames are sent to it must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  // Initialize server address
+  struct sockaddr_in server_addr;
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(port);
+  server_addr.sin_addr.s_addr = INADDR_ANY;
+
+  // Every reactor thread gets its own sockets
+  vector<int> tcp_sockfds(threads);
+  vector<int> udp_sockfds(threads);
+  for (int i = 0; i < threads; i++)
+    open_server_sockets(&server_addr, threads > 1, rcvbuf, &tcp_sockfds[i], &udp_sockfds[i]);
 
   // Run the application
-  run_app_multi_server(tcp_sockfd, udp_sockfd);
+  int stats_fd = stats_path != NULL ? open_stats_socket(stats_path) : -1;
+
+  // Run the application
+  run_app_multi_server(tcp_sockfds, udp_sockfds, edge_triggered, spill_dir, log_dir, stats_fd);
+
+  if (stats_fd >= 0)
+  {
+    close(stats_fd);
+    unlink(stats_path);
+  }
 
   // Close the sockets
-  close(tcp_sockfd);
-  close(udp_sockfd);
+  for (int i = 0; i < threads; i++)
+  {
+    close(tcp_sockfds[i]);
+    close(udp_sockfds[i]);
+  }
 
   return 0;
 }
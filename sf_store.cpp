@@ -0,0 +1,136 @@
+// Description: This file contains the store-and-forward buffers of the clients
+#include "sf_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+struct sf_store *sf_store_new()
+{
+  struct sf_store *store = new sf_store;
+  store->spill_fd = -1;
+  store->spill = NULL;
+  store->spill_len = 0;
+  store->spill_cap = 0;
+  store->frames = 0;
+  store->dropped = 0;
+  return store;
+}
+
+static void close_spill(struct sf_store *store)
+{
+  if (store->spill != NULL)
+    munmap(store->spill, store->spill_cap);
+  if (store->spill_fd >= 0)
+    close(store->spill_fd);
+
+  store->spill_fd = -1;
+  store->spill = NULL;
+  store->spill_len = 0;
+  store->spill_cap = 0;
+}
+
+void sf_store_free(struct sf_store *store)
+{
+  close_spill(store);
+  delete store;
+}
+
+// Creates the spill file, only the descriptor keeps it alive
+static bool open_spill(struct sf_store *store, const char *dir)
+{
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/messagestream-XXXXXX", dir);
+
+  int fd = mkstemp(path);
+  if (fd < 0)
+  {
+    perror("Create spill file ERROR");
+    return false;
+  }
+  unlink(path);
+
+  store->spill_fd = fd;
+  return true;
+}
+
+// Makes room for len more bytes in the spill file
+static bool grow_spill(struct sf_store *store, size_t len)
+{
+  if (store->spill_len + len <= store->spill_cap)
+    return true;
+
+  size_t cap = store->spill_cap > 0 ? store->spill_cap : SF_SPILL_INITIAL;
+  while (cap < store->spill_len + len)
+    cap *= 2;
+
+  if (ftruncate(store->spill_fd, cap) < 0)
+  {
+    perror("Grow spill file ERROR");
+    return false;
+  }
+
+  void *spill;
+  if (store->spill == NULL)
+    spill = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, store->spill_fd, 0);
+  else
+    spill = mremap(store->spill, store->spill_cap, cap, MREMAP_MAYMOVE);
+
+  if (spill == MAP_FAILED)
+  {
+    perror("Map spill file ERROR");
+    return false;
+  }
+
+  store->spill = (char *)spill;
+  store->spill_cap = cap;
+  return true;
+}
+
+bool sf_store_append(struct sf_store *store, const char *dir, const void *frame, size_t len)
+{
+  // Frames go to memory until the budget is used, then all the later ones go
+  // to the file so that the order is kept
+  if (store->spill_fd < 0 && store->memory.size() + len <= SF_MEMORY_BUDGET)
+  {
+    const char *data = (const char *)frame;
+    store->memory.insert(store->memory.end(), data, data + len);
+    store->frames++;
+    return true;
+  }
+
+  if (store->spill_len + len > SF_SPILL_LIMIT)
+  {
+    store->dropped++;
+    return false;
+  }
+
+  if ((store->spill_fd < 0 && !open_spill(store, dir)) || !grow_spill(store, len))
+  {
+    store->dropped++;
+    return false;
+  }
+
+  memcpy(store->spill + store->spill_len, frame, len);
+  store->spill_len += len;
+  store->frames++;
+  return true;
+}
+
+void sf_store_drain(struct sf_store *store, sf_store_visitor visit, void *ctx)
+{
+  if (!store->memory.empty())
+    visit(store->memory.data(), store->memory.size(), ctx);
+  if (store->spill_len > 0)
+    visit(store->spill, store->spill_len, ctx);
+
+  // Give the memory back, the store may stay empty for a long time
+  std::vector<char>().swap(store->memory);
+  close_spill(store);
+  store->frames = 0;
+  store->dropped = 0;
+}
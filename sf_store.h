@@ -0,0 +1,54 @@
+// SF_STORE -- Messages kept for an offline client (store-and-forward) -- Header file
+#ifndef _SF_STORE_H
+#define _SF_STORE_H 1
+
+#include <stddef.h>
+#include <mutex>
+#include <vector>
+
+// Bytes of frames a client keeps in memory before spilling to a file
+#define SF_MEMORY_BUDGET (256 * 1024)
+
+// Bytes of frames a client keeps in its spill file, the newer frames are dropped
+#define SF_SPILL_LIMIT (64 * 1024 * 1024)
+
+// Initial size of a spill file, doubled when it is full
+#define SF_SPILL_INITIAL (1024 * 1024)
+
+// POST frames (PO_TCP v2 encoding) published while a client was offline,
+// oldest first: the first SF_MEMORY_BUDGET bytes in memory, the rest in a
+// memory-mapped file that is unlinked as soon as it is created
+struct sf_store
+{
+  // Taken by the threads that store frames and by the one that replays them
+  std::mutex lock;
+
+  std::vector<char> memory;
+
+  // Spill file, -1 until the memory budget is exceeded
+  int spill_fd;
+  char *spill;
+  size_t spill_len;
+  size_t spill_cap;
+
+  // Frames kept and frames dropped because the store was full
+  size_t frames;
+  size_t dropped;
+};
+
+// Called with the stored frames, in order, in chunks made of whole frames
+typedef void (*sf_store_visitor)(const char *data, size_t len, void *ctx);
+
+struct sf_store *sf_store_new();
+void sf_store_free(struct sf_store *store);
+
+// Appends a frame; the spill file is created in dir if needed
+// Returns false if the frame was dropped
+// The caller holds store->lock
+bool sf_store_append(struct sf_store *store, const char *dir, const void *frame, size_t len);
+
+// Visits the stored frames then empties the store and removes its spill file
+// The caller holds store->lock
+void sf_store_drain(struct sf_store *store, sf_store_visitor visit, void *ctx);
+
+#endif
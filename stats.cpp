@@ -0,0 +1,241 @@
+// Description: This file contains the counters and latency histograms of the broker
+#include "stats.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+using namespace std;
+
+// Nanoseconds per tick, and the time the statistics started at
+static double ns_per_tick = 1.0;
+static uint64_t started_at_ns;
+
+static uint64_t monotonic_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void stats_init()
+{
+  started_at_ns = monotonic_ns();
+
+#ifdef HAVE_TSC
+  // Count the ticks of a short sleep
+  uint64_t start_ns = monotonic_ns();
+  uint64_t start_ticks = __rdtsc();
+  usleep(20000);
+  uint64_t ticks = __rdtsc() - start_ticks;
+  uint64_t ns = monotonic_ns() - start_ns;
+
+  if (ticks > 0)
+    ns_per_tick = (double)ns / ticks;
+#endif
+}
+
+uint64_t stats_now()
+{
+#ifdef HAVE_TSC
+  return __rdtsc();
+#else
+  return monotonic_ns();
+#endif
+}
+
+uint64_t stats_ticks_to_ns(uint64_t ticks)
+{
+  return (uint64_t)(ticks * ns_per_tick);
+}
+
+static void histogram_init(struct stat_histogram *histogram)
+{
+  for (int i = 0; i < STAT_BUCKETS; i++)
+    histogram->buckets[i] = 0;
+  histogram->count = 0;
+  histogram->sum = 0;
+  histogram->max = 0;
+}
+
+void shard_stats_init(struct shard_stats *stats)
+{
+  stats->datagrams = 0;
+  stats->datagram_bytes = 0;
+  stats->udp_drops = 0;
+  stats->matched = 0;
+  stats->deliveries = 0;
+  stats->routed_out = 0;
+  stats->routed_in = 0;
+  stats->connections = 0;
+  stats->slow_connections = 0;
+  stats->queued_bytes = 0;
+
+  histogram_init(&stats->fanout);
+  for (int i = 0; i < STAGE_COUNT; i++)
+    histogram_init(&stats->stages[i]);
+}
+
+void stat_record(struct stat_histogram *histogram, uint64_t value)
+{
+  int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+  if (bucket >= STAT_BUCKETS)
+    bucket = STAT_BUCKETS - 1;
+
+  stat_add(histogram->buckets[bucket], 1);
+  stat_add(histogram->count, 1);
+  stat_add(histogram->sum, value);
+  if (value > histogram->max.load(memory_order_relaxed))
+    histogram->max.store(value, memory_order_relaxed);
+}
+
+// A histogram summed over the threads
+struct histogram_summary
+{
+  uint64_t buckets[STAT_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+};
+
+static void summarize(const vector<struct shard_stats *> &shards, const struct stat_histogram *(*pick)(const struct shard_stats *, int),
+                      int index, struct histogram_summary *summary)
+{
+  *summary = {};
+  for (const struct shard_stats *stats : shards)
+  {
+    const struct stat_histogram *histogram = pick(stats, index);
+    for (int i = 0; i < STAT_BUCKETS; i++)
+      summary->buckets[i] += histogram->buckets[i].load(memory_order_relaxed);
+    summary->count += histogram->count.load(memory_order_relaxed);
+    summary->sum += histogram->sum.load(memory_order_relaxed);
+    summary->max = max(summary->max, histogram->max.load(memory_order_relaxed));
+  }
+}
+
+static const struct stat_histogram *pick_stage(const struct shard_stats *stats, int stage)
+{
+  return &stats->stages[stage];
+}
+
+static const struct stat_histogram *pick_fanout(const struct shard_stats *stats, int)
+{
+  return &stats->fanout;
+}
+
+// Upper bound of the bucket that holds the given fraction of the values
+static uint64_t percentile(const struct histogram_summary *summary, double fraction)
+{
+  if (summary->count == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t)(summary->count * fraction);
+  uint64_t seen = 0;
+  for (int i = 0; i < STAT_BUCKETS; i++)
+  {
+    seen += summary->buckets[i];
+    if (seen > rank)
+      return min(i == 0 ? 0 : 1ULL << i, summary->max);
+  }
+
+  return summary->max;
+}
+
+// Counters summed over the threads
+struct stats_summary
+{
+  double uptime;
+  uint64_t datagrams, datagram_bytes, udp_drops;
+  uint64_t matched, deliveries, routed_out, routed_in;
+  int64_t connections, slow_connections, queued_bytes;
+  struct histogram_summary fanout;
+  struct histogram_summary stages[STAGE_COUNT];
+};
+
+static void summarize_all(const vector<struct shard_stats *> &shards, struct stats_summary *summary)
+{
+  *summary = {};
+  summary->uptime = (monotonic_ns() - started_at_ns) / 1e9;
+
+  for (const struct shard_stats *stats : shards)
+  {
+    summary->datagrams += stats->datagrams.load(memory_order_relaxed);
+    summary->datagram_bytes += stats->datagram_bytes.load(memory_order_relaxed);
+    summary->udp_drops += stats->udp_drops.load(memory_order_relaxed);
+    summary->matched += stats->matched.load(memory_order_relaxed);
+    summary->deliveries += stats->deliveries.load(memory_order_relaxed);
+    summary->routed_out += stats->routed_out.load(memory_order_relaxed);
+    summary->routed_in += stats->routed_in.load(memory_order_relaxed);
+    summary->connections += stats->connections.load(memory_order_relaxed);
+    summary->slow_connections += stats->slow_connections.load(memory_order_relaxed);
+    summary->queued_bytes += stats->queued_bytes.load(memory_order_relaxed);
+  }
+
+  summarize(shards, pick_fanout, 0, &summary->fanout);
+  for (int stage = 0; stage < STAGE_COUNT; stage++)
+    summarize(shards, pick_stage, stage, &summary->stages[stage]);
+}
+
+static const char *stage_names[STAGE_COUNT] = {"ingest", "match", "enqueue", "send", "total"};
+
+void stats_print(const vector<struct shard_stats *> &shards, FILE *out)
+{
+  struct stats_summary s;
+  summarize_all(shards, &s);
+
+  double rate = s.uptime > 0 ? s.datagrams / s.uptime : 0;
+  double fanout = s.fanout.count > 0 ? (double)s.fanout.sum / s.fanout.count : 0;
+
+  fprintf(out, "Uptime %.1f s, %zu threads\n", s.uptime, shards.size());
+  fprintf(out, "Datagrams: %lu (%lu bytes, %.0f/s), dropped by the kernel: %lu\n", s.datagrams, s.datagram_bytes, rate,
+          s.udp_drops);
+  fprintf(out, "Fan-out: %.2f subscribers/datagram (p99 %lu, max %lu), %lu POSTs queued\n", fanout,
+          percentile(&s.fanout, 0.99), s.fanout.max, s.deliveries);
+  fprintf(out, "Routed to other threads: %lu, from other threads: %lu\n", s.routed_out, s.routed_in);
+  fprintf(out, "Connections: %ld, slow: %ld, queued: %ld bytes\n", s.connections, s.slow_connections, s.queued_bytes);
+
+  for (int stage = 0; stage < STAGE_COUNT; stage++)
+  {
+    const struct histogram_summary *h = &s.stages[stage];
+    fprintf(out, "%-8s count %lu, mean %lu ns, p50 %lu ns, p99 %lu ns, max %lu ns\n", stage_names[stage], h->count,
+            h->count > 0 ? h->sum / h->count : 0, percentile(h, 0.5), percentile(h, 0.99), h->max);
+  }
+
+  fflush(out);
+}
+
+string stats_json(const vector<struct shard_stats *> &shards)
+{
+  struct stats_summary s;
+  summarize_all(shards, &s);
+
+  char buffer[512];
+  string json;
+
+  snprintf(buffer, sizeof(buffer),
+           "{\"uptime\":%.3f,\"threads\":%zu,\"datagrams\":%lu,\"datagram_bytes\":%lu,\"udp_drops\":%lu,"
+           "\"matched\":%lu,\"deliveries\":%lu,\"routed_out\":%lu,\"routed_in\":%lu,"
+           "\"connections\":%ld,\"slow_connections\":%ld,\"queued_bytes\":%ld,",
+           s.uptime, shards.size(), s.datagrams, s.datagram_bytes, s.udp_drops, s.matched, s.deliveries, s.routed_out,
+           s.routed_in, s.connections, s.slow_connections, s.queued_bytes);
+  json += buffer;
+
+  snprintf(buffer, sizeof(buffer), "\"fanout\":{\"count\":%lu,\"sum\":%lu,\"p50\":%lu,\"p99\":%lu,\"max\":%lu},\"stages_ns\":{",
+           s.fanout.count, s.fanout.sum, percentile(&s.fanout, 0.5), percentile(&s.fanout, 0.99), s.fanout.max);
+  json += buffer;
+
+  for (int stage = 0; stage < STAGE_COUNT; stage++)
+  {
+    const struct histogram_summary *h = &s.stages[stage];
+    snprintf(buffer, sizeof(buffer), "%s\"%s\":{\"count\":%lu,\"sum\":%lu,\"p50\":%lu,\"p99\":%lu,\"max\":%lu}",
+             stage == 0 ? "" : ",", stage_names[stage], h->count, h->sum, percentile(h, 0.5), percentile(h, 0.99), h->max);
+    json += buffer;
+  }
+
+  json += "}}\n";
+  return json;
+}
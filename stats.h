@@ -0,0 +1,94 @@
+// STATS -- Counters and latency histograms of the broker -- Header file
+#ifndef _STATS_H
+#define _STATS_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+// Histogram buckets: bucket i counts the values in [2^(i-1), 2^i)
+#define STAT_BUCKETS 40
+
+// Stages of a datagram, timed by the thread that runs them
+#define STAGE_INGEST 0   // recvmmsg of a batch
+#define STAGE_MATCH 1    // lookup of the subscribers of one datagram
+#define STAGE_ENQUEUE 2  // encoding and queueing of one POST
+#define STAGE_SEND 3     // flush of the queues written during a wakeup
+#define STAGE_TOTAL 4    // from the receive to the flush that sent it
+#define STAGE_COUNT 5
+
+// A histogram of values with power-of-two buckets
+// Written by one thread, read by any: the updates are relaxed stores
+struct stat_histogram
+{
+  std::atomic<uint64_t> buckets[STAT_BUCKETS];
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> max;
+};
+
+// Statistics of one reactor thread, written by that thread only
+struct shard_stats
+{
+  // Datagrams and bytes received, and datagrams the kernel dropped
+  std::atomic<uint64_t> datagrams;
+  std::atomic<uint64_t> datagram_bytes;
+  std::atomic<uint64_t> udp_drops;
+
+  // Subscribers matched, POST frames queued, POSTs handed to and received
+  // from the other threads
+  std::atomic<uint64_t> matched;
+  std::atomic<uint64_t> deliveries;
+  std::atomic<uint64_t> routed_out;
+  std::atomic<uint64_t> routed_in;
+
+  // Open connections, connections waiting for EPOLLOUT and the bytes in
+  // their queues at their last flush
+  std::atomic<int64_t> connections;
+  std::atomic<int64_t> slow_connections;
+  std::atomic<int64_t> queued_bytes;
+
+  // Subscribers matched per datagram, and the time of every stage, in ns
+  struct stat_histogram fanout;
+  struct stat_histogram stages[STAGE_COUNT];
+};
+
+// Measures the rate of the time stamp counter; called once at startup
+void stats_init();
+
+// Current time stamp, in ticks of the TSC (or ns where there is none)
+uint64_t stats_now();
+
+// Converts a difference of time stamps to ns
+uint64_t stats_ticks_to_ns(uint64_t ticks);
+
+void shard_stats_init(struct shard_stats *stats);
+
+// Increments a counter of the calling thread's statistics
+inline void stat_add(std::atomic<uint64_t> &counter, uint64_t value)
+{
+  counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+inline void stat_add(std::atomic<int64_t> &gauge, int64_t value)
+{
+  gauge.store(gauge.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+// Adds a value to a histogram of the calling thread's statistics
+void stat_record(struct stat_histogram *histogram, uint64_t value);
+
+// Adds the time elapsed since start to the histogram of a stage
+inline void stat_record_since(struct shard_stats *stats, int stage, uint64_t start)
+{
+  stat_record(&stats->stages[stage], stats_ticks_to_ns(stats_now() - start));
+}
+
+// Writes the sum of the statistics of all the threads, as text or as JSON
+void stats_print(const std::vector<struct shard_stats *> &shards, FILE *out);
+std::string stats_json(const std::vector<struct shard_stats *> &shards);
+
+#endif
@@ -1,85 +1,221 @@
 // Description: This file contains the implementation of the TCP subscriber
 #include "headers.h"
 #include "utils.h"
+#include "frame.h"
+#include "payload.h"
 
-// Function that gets the integer value from the content
-int get_INT_value(char *content)
-{
-    // Get the sign of the integer
-    int8_t sign = content[0];
+// Size of the buffer for the data received from the server
+#define RECV_BUF_LEN (64 * 1024)
+
+// Size of the stdout buffer; it is flushed once per wakeup
+#define OUT_BUF_LEN (256 * 1024)
 
-    // Get the integer value
-    uint32_t value = 0;
-    memcpy(&value, content + sizeof(int8_t), sizeof(uint32_t));
-    value = ntohl(value);
+// Function that prints the messages published by UDP clients
+// The contents are decoded together, then the lines go to the stdout buffer
+void print_posts(const struct payload_ref *refs, size_t count)
+{
+    struct payload_value values[PAYLOAD_BATCH];
+    payload_decode_batch(refs, count, values);
 
-    // Return the integer value based on the sign
-    return sign == 0 ? value : -value;
+    char line[MAX_PAYLOAD_TEXT_LEN];
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t len = payload_format(line, &refs[i], &values[i]);
+        if (len > 0)
+            fwrite(line, 1, len, stdout);
+        else if (values[i].status == PAYLOAD_SHORT)
+            fprintf(stderr, "Invalid message content.\n");
+        else
+            fprintf(stderr, "Invalid message type.\n");
+    }
 }
 
-// Function that gets the short real value from the content
-float get_SHORT_REAL_value(char *content)
+// Function that handles a message/response from the server
+// Returns false if the server disconnected the client
+bool handle_response(uint8_t op_code, const char *topic, size_t topic_len)
 {
-    // Get the short real value
-    uint16_t value = 0;
-    memcpy(&value, content, sizeof(uint16_t));
-    value = ntohs(value);
+    // Check the response code
+    switch (op_code)
+    {
+    case SUBSCRIBE_ACK:
+        printf("Subscribed to topic %.*s\n", (int)topic_len, topic);
+        break;
+    case UNSUBSCRIBE_ACK:
+        printf("Unsubscribed from topic %.*s\n", (int)topic_len, topic);
+        break;
+    case DISCONNECT:
+        fprintf(stderr, "Disconnected from server.\n");
+        return false;
+    default:
+        fprintf(stderr, "Invalid response code.\n");
+        break;
+    }
 
-    // Return the float value
-    return (float)value / 100;
+    return true;
 }
 
-// Function that gets the float value from the content
-float get_FLOAT_value(char *content)
+// Function that handles all the whole messages at the start of buffer
+// Returns the number of bytes used, or -1 if the client has to stop
+ssize_t handle_received(char *buffer, size_t len, uint8_t version)
 {
-    // Get the sign of the float
-    int8_t sign = content[0];
+    size_t offset = 0;
+
+    // POSTs waiting to be printed, pointing into buffer
+    struct payload_ref posts[PAYLOAD_BATCH];
+    size_t post_count = 0;
+
+    while (offset < len)
+    {
+        const char *data = buffer + offset;
+        size_t available = len - offset;
+        struct payload_ref *post = &posts[post_count];
+        uint8_t op_code;
+        const char *topic;
+        size_t topic_len;
+
+        if (version == PO_TCP_V1)
+        {
+            // v1 messages have a fixed size
+            if (available < sizeof(struct tcp_message))
+                break;
+
+            // The structure is packed, it is read in place
+            const struct tcp_message *response = (const struct tcp_message *)data;
+            offset += sizeof(struct tcp_message);
+
+            op_code = response->op_code;
+            if (op_code == POST)
+            {
+                const struct udp_message *message = &response->message;
+                post->topic = message->topic;
+                post->topic_len = strnlen(message->topic, MAX_TOPIC_LEN);
+                post->data_type = message->data_type;
+                post->content = message->content;
+                post->content_len = MAX_CONTENT_LEN;
+            }
+
+            topic = response->topic;
+            topic_len = strnlen(response->topic, MAX_TOPIC_LEN);
+        }
+        else
+        {
+            // v2 frames carry their length
+            struct frame frame;
+            ssize_t frame_len = frame_parse(data, available, &frame);
+            if (frame_len == 0)
+                break;
+
+            if (frame_len < 0)
+            {
+                fprintf(stderr, "Invalid frame.\n");
+                return -1;
+            }
+            offset += frame_len;
 
-    // Get the float value
-    uint32_t value = 0;
-    memcpy(&value, content + sizeof(int8_t), sizeof(uint32_t));
-    value = ntohl(value);
+            op_code = frame.op_code;
+            if (op_code == POST)
+            {
+                struct post_view view;
+                if (!frame_parse_post(&frame, &view))
+                {
+                    fprintf(stderr, "Invalid frame.\n");
+                    return -1;
+                }
+
+                post->topic = view.topic;
+                post->topic_len = view.topic_len;
+                post->data_type = view.data_type;
+                post->content = view.content;
+                post->content_len = view.content_len;
+            }
 
-    // Get the power of 10
-    int8_t power = content[sizeof(int8_t) + sizeof(uint32_t)];
+            topic = frame.body;
+            topic_len = min(frame.body_len, (size_t)MAX_TOPIC_LEN);
+        }
+
+        if (op_code == POST)
+        {
+            if (++post_count == PAYLOAD_BATCH)
+            {
+                print_posts(posts, post_count);
+                post_count = 0;
+            }
+            continue;
+        }
 
-    // Return the float value based on the sign and power
-    return sign == 0 ? (float)value / pow(10, power) : -(float)value / pow(10, power);
+        // The responses are printed after the POSTs received before them
+        print_posts(posts, post_count);
+        post_count = 0;
+
+        if (!handle_response(op_code, topic, topic_len))
+            return -1;
+    }
+
+    print_posts(posts, post_count);
+    return offset;
 }
 
-// Function that parses the response from the server
-void parse_response(struct tcp_message response)
+// Function that sends a SUBSCRIBE/UNSUBSCRIBE/DISCONNECT request to the server
+int send_request(int tcp_sockfd, uint8_t version, uint8_t op_code, const char *client_id, const char *topic)
 {
-    // Print the message received from the server
-    // FORMAT: "<TOPIC> - <TIP_DATE> - <VALOARE_MESAJ>"
-    switch (response.message.data_type)
+    size_t topic_len = topic != NULL ? strnlen(topic, MAX_TOPIC_LEN) : 0;
+
+    if (version == PO_TCP_V2)
     {
-    case TYPE_INT:
-        printf("%s - INT - %d\n", response.message.topic, get_INT_value(response.message.content));
-        break;
-    case TYPE_SHORT_REAL:
-        printf("%s - SHORT_REAL - %.2f\n", response.message.topic, get_SHORT_REAL_value(response.message.content));
-        break;
-    case TYPE_FLOAT:
-        printf("%s - FLOAT - %.4f\n", response.message.topic, get_FLOAT_value(response.message.content));
-        break;
-    case TYPE_STRING:
-        printf("%s - STRING - %s\n", response.message.topic, response.message.content);
-        break;
-    default:
-        fprintf(stderr, "Invalid message type.\n");
-        break;
+        // The client ID is known by the server from CONNECT
+        char buffer[MAX_FRAME_HEADER_LEN + MAX_TOPIC_LEN];
+        size_t len = frame_build(buffer, op_code, topic, topic_len);
+        return send_all(tcp_sockfd, buffer, len);
     }
+
+    struct tcp_message message;
+    memset(&message, 0, sizeof(struct tcp_message));
+    message.op_code = op_code;
+    memcpy(message.topic, topic, topic_len);
+    strncpy(message.id, client_id, MAX_ID_LEN);
+    return send_all(tcp_sockfd, &message, sizeof(struct tcp_message));
 }
 
-void run_client(int tcp_sockfd, char *client_id)
+// Function that sends a SUBSCRIBE_FROM request to the server
+int send_subscribe_from(int tcp_sockfd, uint8_t version, const char *client_id, const char *topic, uint8_t from,
+                        uint64_t value)
+{
+    size_t topic_len = strnlen(topic, MAX_TOPIC_LEN);
+    uint64_t be_value = htobe64(value);
+
+    if (version == PO_TCP_V2)
+    {
+        char body[SUBSCRIBE_FROM_LEN + MAX_TOPIC_LEN];
+        body[0] = from;
+        memcpy(body + 1, &be_value, sizeof(uint64_t));
+        memcpy(body + SUBSCRIBE_FROM_LEN, topic, topic_len);
+
+        char buffer[MAX_FRAME_HEADER_LEN + SUBSCRIBE_FROM_LEN + MAX_TOPIC_LEN];
+        size_t len = frame_build(buffer, SUBSCRIBE_FROM, body, SUBSCRIBE_FROM_LEN + topic_len);
+        return send_all(tcp_sockfd, buffer, len);
+    }
+
+    struct tcp_message message;
+    memset(&message, 0, sizeof(struct tcp_message));
+    message.op_code = SUBSCRIBE_FROM;
+    memcpy(message.topic, topic, topic_len);
+    strncpy(message.id, client_id, MAX_ID_LEN);
+    message.message.data_type = from;
+    memcpy(message.message.content, &be_value, sizeof(uint64_t));
+    return send_all(tcp_sockfd, &message, sizeof(struct tcp_message));
+}
+
+void run_client(int tcp_sockfd, char *client_id, uint8_t version)
 {
     // Declare the variables used in the client
     struct pollfd fds[2];
-    struct tcp_message message;
-    struct tcp_message response;
     int rc;
 
+    // Data received from the server that does not form a whole message yet
+    char *in_buf = (char *)malloc(RECV_BUF_LEN);
+    DIE(in_buf == NULL, "malloc");
+    size_t in_len = 0;
+
     // Add the STDIN to the poll
     fds[0].fd = STDIN_FILENO;
     fds[0].events = POLLIN;
@@ -98,7 +234,8 @@ void run_client(int tcp_sockfd, char *client_id)
         if (fds[0].revents & POLLIN)
         {
             // Read the input from STDIN
-            // Input format is subscribe <topic>, unsubscribe <topic>, exit
+            // Input format is subscribe <topic> [0|1], subscribe <topic> from <offset>,
+            // subscribe <topic> since <unix time>, unsubscribe <topic>, exit
             char buffer[BUFLEN];
             memset(buffer, 0, BUFLEN);
 
@@ -118,21 +255,38 @@ void run_client(int tcp_sockfd, char *client_id)
             if (strcmp(token, "subscribe") == 0)
             {
                 // Send a message to the server to subscribe to a topic
-                token = strtok(NULL, " ");
-                if (token == NULL)
+                // An optional SF flag of 1 asks for store-and-forward
+                // "from <offset>" or "since <unix time>" asks for a replay of the
+                // log of the server
+                token = strtok(NULL, " \n");
+                char *sf = strtok(NULL, " \n");
+                if (token != NULL && sf != NULL && (strcmp(sf, "from") == 0 || strcmp(sf, "since") == 0))
                 {
-                    fprintf(stderr, "Invalid command.\n");
+                    char *value = strtok(NULL, " \n");
+                    unsigned long long start;
+                    if (value == NULL || sscanf(value, "%llu", &start) != 1)
+                    {
+                        fprintf(stderr, "Invalid command.\n");
+                        continue;
+                    }
+
+                    if (strcmp(sf, "from") == 0)
+                        rc = send_subscribe_from(tcp_sockfd, version, client_id, token, FROM_OFFSET, start);
+                    else
+                        rc = send_subscribe_from(tcp_sockfd, version, client_id, token, FROM_TIME, start * 1000000);
+                    DIE(rc < 0, "send_all");
                     continue;
                 }
 
-                // Erase the '\n' from the token
-                token[strlen(token) - 1] = '\0';
+                if (token == NULL || (sf != NULL && strcmp(sf, "0") != 0 && strcmp(sf, "1") != 0))
+                {
+                    fprintf(stderr, "Invalid command.\n");
+                    continue;
+                }
 
                 // Send the message to the server
-                message.op_code = SUBSCRIBE;
-                strncpy(message.topic, token, MAX_TOPIC_LEN);
-                strncpy(message.id, client_id, MAX_ID_LEN);
-                rc = send_all(tcp_sockfd, &message, sizeof(struct tcp_message));
+                uint8_t op_code = sf != NULL && strcmp(sf, "1") == 0 ? SUBSCRIBE_SF : SUBSCRIBE;
+                rc = send_request(tcp_sockfd, version, op_code, client_id, token);
                 DIE(rc < 0, "send_all");
             }
             else if (strcmp(token, "unsubscribe") == 0)
@@ -149,65 +303,81 @@ void run_client(int tcp_sockfd, char *client_id)
                 token[strlen(token) - 1] = '\0';
 
                 // Send the message to the server
-                message.op_code = UNSUBSCRIBE;
-                strncpy(message.topic, token, MAX_TOPIC_LEN);
-                strncpy(message.id, client_id, MAX_ID_LEN);
-                rc = send_all(tcp_sockfd, &message, sizeof(struct tcp_message));
+                rc = send_request(tcp_sockfd, version, UNSUBSCRIBE, client_id, token);
                 DIE(rc < 0, "send_all");
             }
             else if (strncmp(token, "exit", 4) == 0)
             {
                 // Send a message to the server to disconnect
-                message.op_code = DISCONNECT;
-                strcpy(message.id, client_id);
-                rc = send_all(tcp_sockfd, &message, sizeof(struct tcp_message));
+                rc = send_request(tcp_sockfd, version, DISCONNECT, client_id, NULL);
                 DIE(rc < 0, "send_all");
-                return;
+                break;
             }
             else
             {
                 fprintf(stderr, "Invalid command.\n");
             }
         }
-        else if (fds[1].revents & POLLIN)
-        {
-            // Receive the message/response from the server
-            rc = recv_all(tcp_sockfd, &response, sizeof(struct tcp_message));
-            DIE(rc < 0, "recv_all");
 
-            // Check the response code
-            switch (response.op_code)
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            // Receive the messages/responses from the server until the
+            // socket is drained, handling every whole message of each read
+            bool stop = false;
+            while (1)
             {
-            case SUBSCRIBE_ACK:
-                printf("Subscribed to topic %s\n", response.topic);
-                break;
-            case UNSUBSCRIBE_ACK:
-                printf("Unsubscribed from topic %s\n", response.topic);
-                break;
-            case POST:
-                parse_response(response);
-                break;
-            case DISCONNECT:
-                fprintf(stderr, "Disconnected from server.\n");
-                return;
-            default:
-                fprintf(stderr, "Invalid response code.\n");
-                break;
+                size_t space = RECV_BUF_LEN - in_len;
+                rc = recv(tcp_sockfd, in_buf + in_len, space, MSG_DONTWAIT);
+                if (rc < 0 && errno == EINTR)
+                    continue;
+                if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break;
+                DIE(rc < 0, "recv");
+
+                // The server closed the connection
+                if (rc == 0)
+                {
+                    fprintf(stderr, "Disconnected from server.\n");
+                    stop = true;
+                    break;
+                }
+                in_len += rc;
+
+                // Handle every whole message, keep the rest for the next read
+                ssize_t used = handle_received(in_buf, in_len, version);
+                if (used < 0)
+                {
+                    stop = true;
+                    break;
+                }
+
+                memmove(in_buf, in_buf + used, in_len - used);
+                in_len -= used;
+
+                // A short read means that the socket was drained
+                if ((size_t)rc < space)
+                    break;
             }
+
+            if (stop)
+                break;
         }
+
+        // The messages printed during this wakeup leave in one write
+        fflush(stdout);
     }
+
+    free(in_buf);
 }
 
 int main(int argc, char *argv[])
 {
-    // Disable buffering for stdout
-    setvbuf(stdout, NULL, _IONBF, BUFSIZ);
     int rc;
 
     // Check if the number of arguments is valid
-    if (argc != 4)
+    if (argc < 4)
     {
-        printf("\n Usage: ./subscriber <CLIENT_ID> <SERVER_IP> <SERVER_PORT>\n");
+        printf("\n Usage: ./subscriber <CLIENT_ID> <SERVER_IP> <SERVER_PORT> [--proto 1|2] [--line-buffered]\n");
         return 1;
     }
 
@@ -216,6 +386,34 @@ int main(int argc, char *argv[])
     char *server_ip = argv[2];
     uint16_t server_port = atoi(argv[3]);
 
+    // Parse the options
+    // The protocol version to ask for is v2 unless the server does not
+    // support it
+    uint8_t version = PO_TCP_V2;
+    bool line_buffered = false;
+    for (int i = 4; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--proto") == 0 && i + 1 < argc)
+            version = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--line-buffered") == 0)
+            line_buffered = true;
+        else
+            version = 0;
+    }
+
+    if (version != PO_TCP_V1 && version != PO_TCP_V2)
+    {
+        printf("\n Usage: ./subscriber <CLIENT_ID> <SERVER_IP> <SERVER_PORT> [--proto 1|2] [--line-buffered]\n");
+        return 1;
+    }
+
+    // The output is written once per wakeup, or line by line for readers
+    // that need every message as soon as it is printed
+    if (line_buffered)
+        setvbuf(stdout, NULL, _IOLBF, OUT_BUF_LEN);
+    else
+        setvbuf(stdout, NULL, _IOFBF, OUT_BUF_LEN);
+
     // Initialize server address
     struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
@@ -233,9 +431,13 @@ int main(int argc, char *argv[])
     DIE(rc < 0, "connect");
 
     // Send a message containing the client_id to the server
+    // CONNECT is always a v1 message, the topic field asks for v2
     struct tcp_message message;
+    memset(&message, 0, sizeof(struct tcp_message));
     message.op_code = CONNECT;
-    strcpy(message.id, client_id);
+    strncpy(message.id, client_id, MAX_ID_LEN);
+    if (version == PO_TCP_V2)
+        memcpy(message.topic, PO_TCP_V2_MAGIC, sizeof(PO_TCP_V2_MAGIC));
     rc = send_all(sockfd, &message, sizeof(struct tcp_message));
 
     // Receive the response from the server
@@ -243,15 +445,19 @@ int main(int argc, char *argv[])
     rc = recv_all(sockfd, &response, sizeof(struct tcp_message));
 
     // Check the response code is CONNECT_ACK
-    if (response.op_code != CONNECT_ACK)
+    if (rc != sizeof(struct tcp_message) || response.op_code != CONNECT_ACK)
     {
         fprintf(stderr, "Connection to server failed or client ID already in use.\n");
         close(sockfd);
         return 1;
     }
 
+    // A server that does not echo the magic only speaks v1
+    if (memcmp(response.topic, PO_TCP_V2_MAGIC, sizeof(PO_TCP_V2_MAGIC)) != 0)
+        version = PO_TCP_V1;
+
     // Run the client
-    run_client(sockfd, client_id);
+    run_client(sockfd, client_id, version);
 
     // Close the socket
     close(sockfd);
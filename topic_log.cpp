@@ -0,0 +1,485 @@
+// Description: This file contains the implementation of the durable topic log
+#include "topic_log.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+static uint32_t checksum(const char *data, size_t len)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+  {
+    hash ^= (uint8_t)data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint64_t now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static string segment_path(struct topic_log *log, uint64_t base_offset, const char *extension)
+{
+  char name[64];
+  snprintf(name, sizeof(name), "/%020" PRIu64 ".%s", base_offset, extension);
+  return log->dir + name;
+}
+
+// Writes len bytes at the end of fd
+static bool write_all(int fd, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t rc = write(fd, data, len);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0)
+      return false;
+
+    data += rc;
+    len -= rc;
+  }
+  return true;
+}
+
+// Opens the files of a segment, creating them if create is set
+static struct log_segment *open_segment(struct topic_log *log, uint64_t base_offset, bool create)
+{
+  int flags = O_RDWR | O_APPEND | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0);
+  int fd = open(segment_path(log, base_offset, "log").c_str(), flags, 0644);
+  if (fd < 0)
+    return NULL;
+
+  int index_fd = open(segment_path(log, base_offset, "idx").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  size_t index_len = LOG_INDEX_ENTRIES * sizeof(struct log_index_entry);
+  if (index_fd < 0 || ftruncate(index_fd, index_len) < 0)
+  {
+    close(fd);
+    if (index_fd >= 0)
+      close(index_fd);
+    return NULL;
+  }
+
+  void *index = mmap(NULL, index_len, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+  if (index == MAP_FAILED)
+  {
+    close(fd);
+    close(index_fd);
+    return NULL;
+  }
+
+  struct log_segment *segment = new log_segment;
+  segment->base_offset = base_offset;
+  segment->fd = fd;
+  segment->index_fd = index_fd;
+  segment->index = (struct log_index_entry *)index;
+
+  // The used entries are a prefix, timestamps are never zero
+  segment->index_count = 0;
+  while (segment->index_count < LOG_INDEX_ENTRIES && segment->index[segment->index_count].timestamp != 0)
+    segment->index_count++;
+
+  struct stat st;
+  fstat(fd, &st);
+  segment->size = st.st_size;
+  segment->last_indexed = segment->index_count > 0 ? segment->index[segment->index_count - 1].position : 0;
+  return segment;
+}
+
+static void close_segment(struct log_segment *segment)
+{
+  fdatasync(segment->fd);
+  msync(segment->index, LOG_INDEX_ENTRIES * sizeof(struct log_index_entry), MS_SYNC);
+  munmap(segment->index, LOG_INDEX_ENTRIES * sizeof(struct log_index_entry));
+  close(segment->fd);
+  close(segment->index_fd);
+  delete segment;
+}
+
+// Checks the records of the last segment after its last index entry, cuts a
+// record torn by a crash and finds the next offset of the log
+static void recover_tail(struct topic_log *log, struct log_segment *segment)
+{
+  // Entries past the end of the file point to records that were lost
+  while (segment->index_count > 0 && segment->index[segment->index_count - 1].position >= segment->size)
+  {
+    segment->index_count--;
+    memset(&segment->index[segment->index_count], 0, sizeof(struct log_index_entry));
+  }
+
+  size_t position = 0;
+  if (segment->index_count > 0)
+  {
+    position = segment->index[segment->index_count - 1].position;
+    log->next_offset = segment->index[segment->index_count - 1].offset;
+    log->last_timestamp = segment->index[segment->index_count - 1].timestamp;
+  }
+  else
+  {
+    log->next_offset = segment->base_offset;
+  }
+  segment->last_indexed = position;
+
+  vector<char> frame;
+  while (position + sizeof(struct log_record_header) <= segment->size)
+  {
+    struct log_record_header header;
+    if (pread(segment->fd, &header, sizeof(header), position) != sizeof(header))
+      break;
+
+    size_t end = position + sizeof(header) + header.len;
+    if (header.offset != log->next_offset || end > segment->size)
+      break;
+
+    frame.resize(header.len);
+    if (pread(segment->fd, frame.data(), header.len, position + sizeof(header)) != (ssize_t)header.len ||
+        checksum(frame.data(), header.len) != header.checksum)
+      break;
+
+    log->next_offset = header.offset + 1;
+    log->last_timestamp = header.timestamp;
+    position = end;
+  }
+
+  if (position < segment->size)
+  {
+    fprintf(stderr, "Log segment %020" PRIu64 " cut after a torn record.\n", segment->base_offset);
+    if (ftruncate(segment->fd, position) == 0)
+      segment->size = position;
+  }
+}
+
+// Writes the pending records to the segments; the caller holds write_lock
+static void write_pending(struct topic_log *log)
+{
+  {
+    lock_guard<mutex> guard(log->lock);
+    swap(log->pending, log->writing);
+    log->drained.notify_all();
+  }
+
+  const char *data = log->writing.data();
+  size_t len = log->writing.size();
+  size_t start = 0;
+  size_t offset = 0;
+
+  while (offset < len)
+  {
+    struct log_record_header header;
+    memcpy(&header, data + offset, sizeof(header));
+    size_t record_len = sizeof(header) + header.len;
+
+    // Close the current segment when the record does not fit in it
+    struct log_segment *segment = log->segments.empty() ? NULL : log->segments.back();
+    size_t position = segment != NULL ? segment->size + (offset - start) : 0;
+    if (segment == NULL || (position > 0 && position + record_len > LOG_SEGMENT_SIZE))
+    {
+      if (segment != NULL)
+      {
+        if (!write_all(segment->fd, data + start, offset - start))
+          perror("Write log segment ERROR");
+        segment->size += offset - start;
+        fdatasync(segment->fd);
+        msync(segment->index, LOG_INDEX_ENTRIES * sizeof(struct log_index_entry), MS_SYNC);
+        start = offset;
+      }
+
+      segment = open_segment(log, header.offset, true);
+      if (segment == NULL)
+      {
+        perror("Create log segment ERROR");
+        break;
+      }
+
+      log->segments.push_back(segment);
+      position = 0;
+    }
+
+    // The first record of a segment is always indexed
+    if ((segment->index_count == 0 || position - segment->last_indexed >= LOG_INDEX_INTERVAL) &&
+        segment->index_count < LOG_INDEX_ENTRIES)
+    {
+      segment->index[segment->index_count].offset = header.offset;
+      segment->index[segment->index_count].timestamp = header.timestamp;
+      segment->index[segment->index_count].position = position;
+      segment->index_count++;
+      segment->last_indexed = position;
+    }
+
+    log->written_offset = header.offset + 1;
+    offset += record_len;
+  }
+
+  if (!log->segments.empty() && offset > start)
+  {
+    struct log_segment *segment = log->segments.back();
+    if (!write_all(segment->fd, data + start, offset - start))
+      perror("Write log segment ERROR");
+    segment->size += offset - start;
+  }
+
+  log->writing.clear();
+}
+
+// Writes the pending records and syncs them, in groups
+static void run_writer(struct topic_log *log)
+{
+  while (1)
+  {
+    {
+      unique_lock<mutex> guard(log->lock);
+      log->wake.wait_for(guard, chrono::milliseconds(LOG_SYNC_INTERVAL_MS),
+                         [log] { return log->stopping || log->pending.size() >= LOG_GROUP_BYTES; });
+
+      if (log->pending.empty())
+      {
+        if (log->stopping)
+          return;
+        continue;
+      }
+    }
+
+    // One write and one fdatasync for all the records of the group
+    int fd;
+    {
+      lock_guard<mutex> guard(log->write_lock);
+      write_pending(log);
+      fd = log->segments.empty() ? -1 : log->segments.back()->fd;
+    }
+
+    if (fd >= 0 && fdatasync(fd) < 0)
+      perror("fdatasync log segment ERROR");
+  }
+}
+
+struct topic_log *topic_log_open(const char *dir)
+{
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    return NULL;
+
+  DIR *d = opendir(dir);
+  if (d == NULL)
+    return NULL;
+
+  struct topic_log *log = new topic_log;
+  log->dir = dir;
+  log->next_offset = 0;
+  log->last_timestamp = 0;
+  log->written_offset = 0;
+  log->stopping = false;
+
+  // Find the segments that are already there
+  vector<uint64_t> bases;
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL)
+  {
+    uint64_t base;
+    char extension[8];
+    if (sscanf(entry->d_name, "%" SCNu64 ".%7s", &base, extension) == 2 && strcmp(extension, "log") == 0)
+      bases.push_back(base);
+  }
+  closedir(d);
+  sort(bases.begin(), bases.end());
+
+  for (uint64_t base : bases)
+  {
+    struct log_segment *segment = open_segment(log, base, false);
+    if (segment == NULL)
+    {
+      perror("Open log segment ERROR");
+      continue;
+    }
+    log->segments.push_back(segment);
+  }
+
+  if (!log->segments.empty())
+    recover_tail(log, log->segments.back());
+  log->written_offset = log->next_offset;
+
+  log->writer = thread(run_writer, log);
+  return log;
+}
+
+void topic_log_close(struct topic_log *log)
+{
+  {
+    lock_guard<mutex> guard(log->lock);
+    log->stopping = true;
+    log->wake.notify_one();
+  }
+  log->writer.join();
+
+  {
+    lock_guard<mutex> guard(log->write_lock);
+    write_pending(log);
+  }
+
+  for (struct log_segment *segment : log->segments)
+    close_segment(segment);
+  delete log;
+}
+
+uint64_t topic_log_append(struct topic_log *log, const void *frame, size_t len)
+{
+  unique_lock<mutex> guard(log->lock);
+
+  // The disk is behind, slow the ingest down instead of growing forever
+  log->drained.wait(guard, [log] { return log->pending.size() < LOG_BUFFER_LIMIT; });
+
+  struct log_record_header header;
+  header.len = len;
+  header.checksum = checksum((const char *)frame, len);
+  header.offset = log->next_offset++;
+  header.timestamp = max(now_us(), log->last_timestamp);
+  log->last_timestamp = header.timestamp;
+
+  const char *data = (const char *)frame;
+  log->pending.insert(log->pending.end(), (const char *)&header, (const char *)&header + sizeof(header));
+  log->pending.insert(log->pending.end(), data, data + len);
+
+  if (log->pending.size() >= LOG_GROUP_BYTES)
+    log->wake.notify_one();
+
+  return header.offset;
+}
+
+uint64_t topic_log_end(struct topic_log *log)
+{
+  lock_guard<mutex> guard(log->lock);
+  return log->next_offset;
+}
+
+// Returns the position of the last index entry of segment for which before
+// is true, 0 if there is none
+template <typename Before>
+static size_t index_lookup(const struct log_segment *segment, Before before)
+{
+  const struct log_index_entry *begin = segment->index;
+  const struct log_index_entry *end = segment->index + segment->index_count;
+  const struct log_index_entry *it = partition_point(begin, end, before);
+  return it == begin ? 0 : (it - 1)->position;
+}
+
+void topic_log_seek(struct topic_log *log, struct log_cursor *cursor, uint64_t offset, uint64_t since, uint64_t end_offset)
+{
+  cursor->next_offset = offset;
+  cursor->end_offset = end_offset;
+  cursor->since = since;
+  cursor->segment = 0;
+  cursor->position = 0;
+
+  lock_guard<mutex> guard(log->write_lock);
+  vector<struct log_segment *> &segments = log->segments;
+
+  // Last segment that starts at or before offset
+  auto by_offset = upper_bound(segments.begin(), segments.end(), offset,
+                               [](uint64_t value, const struct log_segment *segment) { return value < segment->base_offset; });
+
+  // Last segment whose first record is not newer than since
+  auto by_time = upper_bound(segments.begin(), segments.end(), since,
+                             [](uint64_t value, const struct log_segment *segment)
+                             { return segment->index_count > 0 && value < segment->index[0].timestamp; });
+
+  auto it = max(by_offset, by_time);
+  if (it == segments.begin())
+    return;
+
+  cursor->segment = it - 1 - segments.begin();
+  const struct log_segment *segment = segments[cursor->segment];
+  cursor->position = max(index_lookup(segment, [offset](const struct log_index_entry &entry) { return entry.offset <= offset; }),
+                         index_lookup(segment, [since](const struct log_index_entry &entry) { return entry.timestamp <= since; }));
+}
+
+bool topic_log_read(struct topic_log *log, struct log_cursor *cursor, log_visitor visit, void *ctx)
+{
+  int fd;
+  size_t available;
+  {
+    lock_guard<mutex> guard(log->write_lock);
+
+    // The end of the cursor may still be waiting for the writer thread
+    if (log->written_offset < cursor->end_offset)
+      write_pending(log);
+
+    while (1)
+    {
+      if (cursor->next_offset >= cursor->end_offset || cursor->segment >= log->segments.size())
+        return false;
+
+      struct log_segment *segment = log->segments[cursor->segment];
+      if (cursor->position < segment->size)
+      {
+        fd = segment->fd;
+        available = segment->size - cursor->position;
+        break;
+      }
+
+      if (cursor->segment + 1 >= log->segments.size())
+        return false;
+
+      cursor->segment++;
+      cursor->position = 0;
+    }
+  }
+
+  // The written part of a segment does not change, it is read without lock
+  size_t len = min(available, (size_t)LOG_READ_CHUNK);
+  cursor->buffer.resize(len);
+  ssize_t rc = pread(fd, cursor->buffer.data(), len, cursor->position);
+  if (rc <= 0)
+  {
+    perror("Read log segment ERROR");
+    return false;
+  }
+
+  const char *data = cursor->buffer.data();
+  size_t offset = 0;
+  while (offset + sizeof(struct log_record_header) <= (size_t)rc)
+  {
+    struct log_record_header header;
+    memcpy(&header, data + offset, sizeof(header));
+    if (offset + sizeof(header) + header.len > (size_t)rc)
+      break;
+
+    if (header.offset >= cursor->end_offset)
+    {
+      cursor->next_offset = cursor->end_offset;
+      return false;
+    }
+
+    if (header.offset >= cursor->next_offset && header.timestamp >= cursor->since)
+    {
+      visit(header.offset, header.timestamp, data + offset + sizeof(header), header.len, ctx);
+      cursor->next_offset = header.offset + 1;
+    }
+
+    offset += sizeof(header) + header.len;
+  }
+
+  // A record that does not fit in a whole read can only be garbage
+  if (offset == 0)
+  {
+    fprintf(stderr, "Invalid record in the log.\n");
+    return false;
+  }
+
+  // A record never spans two reads, the next one starts at its header
+  cursor->position += offset;
+  return true;
+}
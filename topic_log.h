@@ -0,0 +1,145 @@
+// TOPIC_LOG -- Durable append-only log of the published messages -- Header file
+#ifndef _TOPIC_LOG_H
+#define _TOPIC_LOG_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A segment is closed once it holds this many bytes
+#define LOG_SEGMENT_SIZE (64 * 1024 * 1024)
+
+// A segment gets an index entry every LOG_INDEX_INTERVAL bytes of records
+#define LOG_INDEX_INTERVAL (4 * 1024)
+#define LOG_INDEX_ENTRIES (LOG_SEGMENT_SIZE / LOG_INDEX_INTERVAL + 2)
+
+// Group commit: the appended records are written and synced every
+// LOG_SYNC_INTERVAL_MS, or as soon as LOG_GROUP_BYTES are waiting
+#define LOG_SYNC_INTERVAL_MS 10
+#define LOG_GROUP_BYTES (1024 * 1024)
+
+// Appends wait when this many bytes are waiting for the disk
+#define LOG_BUFFER_LIMIT (64 * 1024 * 1024)
+
+// Bytes of records read by one step of a cursor
+#define LOG_READ_CHUNK (64 * 1024)
+
+#pragma pack(push, 1)
+
+// Header of a record in a segment file, followed by len bytes of frame
+struct log_record_header
+{
+  uint32_t len;
+
+  // FNV-1a of the frame, detects a record torn by a crash
+  uint32_t checksum;
+
+  uint64_t offset;
+
+  // Microseconds since the epoch, never decreasing along the log
+  uint64_t timestamp;
+};
+
+// Entry of the sparse index of a segment; unused entries are zero
+struct log_index_entry
+{
+  uint64_t offset;
+  uint64_t timestamp;
+  uint64_t position;
+};
+
+#pragma pack(pop)
+
+// A segment: <base offset>.log holds the records, <base offset>.idx the
+// memory-mapped index
+struct log_segment
+{
+  uint64_t base_offset;
+  int fd;
+  int index_fd;
+
+  struct log_index_entry *index;
+  size_t index_count;
+
+  // Bytes written to the file, and position of the last indexed record
+  size_t size;
+  size_t last_indexed;
+};
+
+struct topic_log
+{
+  std::string dir;
+
+  // Guards next_offset, last_timestamp and pending
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable drained;
+
+  uint64_t next_offset;
+  uint64_t last_timestamp;
+
+  // Records appended and not written yet
+  std::vector<char> pending;
+
+  // Guards the segments, the files and written_offset; taken by the writer
+  // thread and by the cursors that need records still pending
+  std::mutex write_lock;
+  std::vector<struct log_segment *> segments;
+  std::vector<char> writing;
+
+  // Offset of the first record that was not written to a file
+  uint64_t written_offset;
+
+  // Thread that writes and syncs the pending records
+  std::thread writer;
+  bool stopping;
+};
+
+// A reader of the log, from an offset or a time up to an end offset
+struct log_cursor
+{
+  // Next offset to visit, and the first offset that is not visited
+  uint64_t next_offset;
+  uint64_t end_offset;
+
+  // Records older than this timestamp are skipped
+  uint64_t since;
+
+  // Read position
+  size_t segment;
+  size_t position;
+
+  std::vector<char> buffer;
+};
+
+// Called for the records of a cursor, in offset order
+typedef void (*log_visitor)(uint64_t offset, uint64_t timestamp, const char *frame, size_t len, void *ctx);
+
+// Opens the log in dir, creating it if needed; the records already in dir
+// are kept and a record torn by a crash is cut
+// Returns NULL on error
+struct topic_log *topic_log_open(const char *dir);
+
+// Writes and syncs what is pending, then closes the log
+void topic_log_close(struct topic_log *log);
+
+// Appends a frame; waits only if LOG_BUFFER_LIMIT bytes are not written yet
+// Returns the offset of the record
+uint64_t topic_log_append(struct topic_log *log, const void *frame, size_t len);
+
+// Offset the next appended record will get
+uint64_t topic_log_end(struct topic_log *log);
+
+// Positions a cursor on the first record at or after offset and since (in
+// microseconds since the epoch), up to end_offset excluded
+void topic_log_seek(struct topic_log *log, struct log_cursor *cursor, uint64_t offset, uint64_t since, uint64_t end_offset);
+
+// Visits the records of the next LOG_READ_CHUNK bytes
+// Returns false once the cursor reached its end offset
+bool topic_log_read(struct topic_log *log, struct log_cursor *cursor, log_visitor visit, void *ctx);
+
+#endif
@@ -0,0 +1,137 @@
+// Description: This file contains the implementation of the topic matcher
+#include "topic_match.h"
+
+#include <string.h>
+
+using namespace std;
+
+// Calls add(offset, length) for every non-empty segment of the first len
+// characters of text; returns false if add refuses a segment
+template <typename F>
+static bool for_each_segment(const char *text, size_t len, F add)
+{
+  size_t start = 0;
+  for (size_t i = 0; i <= len; i++)
+  {
+    if (i < len && text[i] != '/' && text[i] != '\0')
+      continue;
+
+    if (i > start && !add(start, i - start))
+      return false;
+
+    if (i < len && text[i] == '\0')
+      break;
+
+    start = i + 1;
+  }
+
+  return true;
+}
+
+bool topic_pattern_compile(struct topic_pattern *pattern, const char *text, size_t len)
+{
+  len = strnlen(text, len);
+  if (len > MAX_TOPIC_LEN)
+    return false;
+
+  memcpy(pattern->text, text, len);
+  pattern->text[len] = '\0';
+  pattern->length = len;
+  pattern->count = 0;
+
+  return for_each_segment(pattern->text, len, [pattern](size_t offset, size_t length) {
+    if (pattern->count == MAX_TOPIC_SEGMENTS)
+      return false;
+
+    uint8_t kind = SEGMENT_LITERAL;
+    if (length == 1 && pattern->text[offset] == '+')
+      kind = SEGMENT_PLUS;
+    else if (length == 1 && pattern->text[offset] == '*')
+      kind = SEGMENT_STAR;
+
+    pattern->segments[pattern->count].offset = offset;
+    pattern->segments[pattern->count].length = length;
+    pattern->segments[pattern->count].kind = kind;
+    pattern->count++;
+    return true;
+  });
+}
+
+bool topic_tokenize(struct topic_tokens *tokens, const char *topic, size_t len)
+{
+  tokens->count = 0;
+
+  return for_each_segment(topic, len, [tokens, topic](size_t offset, size_t length) {
+    if (tokens->count == MAX_TOPIC_SEGMENTS)
+      return false;
+
+    tokens->segments[tokens->count++] = string_view(topic + offset, length);
+    return true;
+  });
+}
+
+bool topic_pattern_match(const struct topic_pattern *pattern, const struct topic_tokens *topic)
+{
+  int count1 = pattern->count, count2 = topic->count;
+
+  // Check if the tokens are matching
+  int index_tokens1 = 0, index_tokens2 = 0;
+  while (index_tokens1 < count1 && index_tokens2 < count2)
+  {
+    uint8_t kind = pattern->segments[index_tokens1].kind;
+
+    // If the tokens are matching or the token in the pattern is "+", continue
+    if (kind == SEGMENT_PLUS || topic_pattern_segment(pattern, index_tokens1) == topic->segments[index_tokens2])
+    {
+      index_tokens1++;
+      index_tokens2++;
+    }
+    else if (kind == SEGMENT_STAR)
+    {
+      // If the "*" token is the last token of the pattern, the topics match
+      if (index_tokens1 == count1 - 1)
+        return true;
+
+      // A "+" right after "*" is skipped, unless it ends the pattern
+      int next = index_tokens1 + 1;
+      if (pattern->segments[next].kind == SEGMENT_PLUS)
+      {
+        if (index_tokens1 == count1 - 2)
+          return true;
+        next++;
+      }
+
+      // Find the first token of the topic that is equal to the token after "*"
+      string_view next_token = topic_pattern_segment(pattern, next);
+      while (index_tokens2 < count2 && topic->segments[index_tokens2] != next_token)
+        index_tokens2++;
+
+      // If the token is not found, the topics do not match
+      if (index_tokens2 == count2)
+        return false;
+
+      // Else, continue from that token
+      index_tokens1 = next;
+    }
+    // Else the topics are not matching
+    else
+    {
+      return false;
+    }
+  }
+
+  // Only a whole match counts, not a partial one
+  return index_tokens1 == count1 && index_tokens2 == count2;
+}
+
+bool topics_are_matching(const char *topic1, const char *topic2)
+{
+  // Both topics are limited to MAX_TOPIC_LEN characters, as on the wire
+  struct topic_pattern pattern;
+  struct topic_tokens tokens;
+
+  topic_pattern_compile(&pattern, topic1, MAX_TOPIC_LEN);
+  topic_tokenize(&tokens, topic2, MAX_TOPIC_LEN);
+
+  return topic_pattern_match(&pattern, &tokens);
+}
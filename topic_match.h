@@ -0,0 +1,63 @@
+// TOPIC_MATCH -- Pre-tokenized topics and patterns -- Header file
+#ifndef _TOPIC_MATCH_H
+#define _TOPIC_MATCH_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+
+#include "po_udp.h"
+
+// A topic of MAX_TOPIC_LEN characters has at most this many non-empty segments
+#define MAX_TOPIC_SEGMENTS (MAX_TOPIC_LEN / 2 + 1)
+
+#define SEGMENT_LITERAL 0
+#define SEGMENT_PLUS 1
+#define SEGMENT_STAR 2
+
+// A subscription pattern, compiled once when the client subscribes
+struct topic_pattern
+{
+  // The pattern, NUL-terminated
+  char text[MAX_TOPIC_LEN + 1];
+  uint8_t length;
+
+  // Segments of the pattern, as offsets in text
+  uint8_t count;
+  struct
+  {
+    uint8_t offset;
+    uint8_t length;
+    uint8_t kind;
+  } segments[MAX_TOPIC_SEGMENTS];
+};
+
+// A topic split in segments, pointing into the buffer it was built from
+struct topic_tokens
+{
+  uint8_t count;
+  std::string_view segments[MAX_TOPIC_SEGMENTS];
+};
+
+// Compiles the first len characters of text (stopping at a NUL)
+// Returns false if the pattern is longer than MAX_TOPIC_LEN
+bool topic_pattern_compile(struct topic_pattern *pattern, const char *text, size_t len);
+
+// Returns the segment index of a compiled pattern
+static inline std::string_view topic_pattern_segment(const struct topic_pattern *pattern, int index)
+{
+  return std::string_view(pattern->text + pattern->segments[index].offset, pattern->segments[index].length);
+}
+
+// Splits the first len characters of topic (stopping at a NUL), without copying
+// Returns false if the topic has more than MAX_TOPIC_SEGMENTS segments
+bool topic_tokenize(struct topic_tokens *tokens, const char *topic, size_t len);
+
+// Checks if a topic matches a compiled pattern, "+" and "*" included
+bool topic_pattern_match(const struct topic_pattern *pattern, const struct topic_tokens *topic);
+
+// Function that checks if two topics are matching
+// Inclunding regexes such as "+" or "*" in topic1
+bool topics_are_matching(const char *topic1, const char *topic2);
+
+#endif
@@ -0,0 +1,248 @@
+// Description: This file contains the implementation of the subscription trie
+#include "topic_trie.h"
+
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+// State of one match of a topic against the trie
+struct trie_walk
+{
+  struct trie_matcher *matcher;
+  const struct topic_tokens *tokens;
+  vector<int> *subscribers;
+};
+
+static struct trie_node *new_node(struct trie_node *parent, string_view segment)
+{
+  struct trie_node *node = new trie_node;
+  node->plus = NULL;
+  node->star = NULL;
+  node->parent = parent;
+  node->segment = segment;
+  return node;
+}
+
+static void free_node(struct trie_node *node)
+{
+  if (node == NULL)
+    return;
+
+  for (auto &child : node->children)
+    free_node(child.second);
+  free_node(node->plus);
+  free_node(node->star);
+  delete node;
+}
+
+// Returns the child of node for segment index of pattern, creating it if
+// create is set
+static struct trie_node *get_child(struct trie_node *node, const struct topic_pattern *pattern, int index, bool create)
+{
+  string_view segment = topic_pattern_segment(pattern, index);
+
+  struct trie_node **slot = NULL;
+  if (pattern->segments[index].kind == SEGMENT_PLUS)
+    slot = &node->plus;
+  else if (pattern->segments[index].kind == SEGMENT_STAR)
+    slot = &node->star;
+
+  if (slot != NULL)
+  {
+    if (*slot == NULL && create)
+      *slot = new_node(node, segment);
+    return *slot;
+  }
+
+  auto it = node->children.find(segment);
+  if (it != node->children.end())
+    return it->second;
+
+  if (!create)
+    return NULL;
+
+  struct trie_node *child = new_node(node, segment);
+  node->children.emplace(string(segment), child);
+  return child;
+}
+
+void topic_trie_init(struct topic_trie *trie)
+{
+  trie->root = new_node(NULL, "");
+  trie->subscriptions = 0;
+  trie_matcher_init(&trie->matcher);
+}
+
+void topic_trie_free(struct topic_trie *trie)
+{
+  free_node(trie->root);
+  trie->root = NULL;
+  trie->subscriptions = 0;
+}
+
+void trie_matcher_init(struct trie_matcher *matcher)
+{
+  matcher->seen.clear();
+  matcher->epoch = 0;
+}
+
+bool topic_trie_subscribe(struct topic_trie *trie, const struct topic_pattern *pattern, int subscriber)
+{
+  // Create the path of the pattern
+  struct trie_node *node = trie->root;
+  for (int i = 0; i < pattern->count; i++)
+    node = get_child(node, pattern, i, true);
+
+  if (!node->subscribers.insert(subscriber).second)
+    return false;
+
+  trie->subscriptions++;
+  return true;
+}
+
+bool topic_trie_unsubscribe(struct topic_trie *trie, const struct topic_pattern *pattern, int subscriber)
+{
+  // Follow the path of the pattern
+  struct trie_node *node = trie->root;
+  for (int i = 0; i < pattern->count; i++)
+  {
+    node = get_child(node, pattern, i, false);
+    if (node == NULL)
+      return false;
+  }
+
+  if (node->subscribers.erase(subscriber) == 0)
+    return false;
+
+  trie->subscriptions--;
+
+  // Remove the nodes that no longer lead to any subscription
+  while (node != trie->root && node->subscribers.empty() && node->children.empty() &&
+         node->plus == NULL && node->star == NULL)
+  {
+    struct trie_node *parent = node->parent;
+    if (parent->plus == node)
+      parent->plus = NULL;
+    else if (parent->star == node)
+      parent->star = NULL;
+    else
+      parent->children.erase(node->segment);
+
+    delete node;
+    node = parent;
+  }
+
+  return true;
+}
+
+// Adds the subscribers of a node to the result, skipping the ones already found
+static void add_subscribers(struct trie_walk *walk, struct trie_node *node)
+{
+  struct trie_matcher *matcher = walk->matcher;
+
+  for (int subscriber : node->subscribers)
+  {
+    if ((size_t)subscriber >= matcher->seen.size())
+      matcher->seen.resize(subscriber + 1, 0);
+
+    if (matcher->seen[subscriber] == matcher->epoch)
+      continue;
+
+    matcher->seen[subscriber] = matcher->epoch;
+    walk->subscribers->push_back(subscriber);
+  }
+}
+
+static void walk_node(struct trie_walk *walk, struct trie_node *node, size_t index);
+
+// Continues the walk in node after the first segment of the topic, starting
+// from index, that is equal to segment
+static void walk_after_segment(struct trie_walk *walk, string_view segment, struct trie_node *node, size_t index)
+{
+  const struct topic_tokens *tokens = walk->tokens;
+
+  while (index < tokens->count && tokens->segments[index] != segment)
+    index++;
+
+  if (index < tokens->count)
+    walk_node(walk, node, index + 1);
+}
+
+// Walks the patterns that continue with "*" at segment index of the topic
+// Same as topics_are_matching: "*" skips segments up to the first one equal
+// to the segment that follows it (a "+" right after "*" is skipped as well)
+static void walk_star(struct trie_walk *walk, struct trie_node *star, size_t index)
+{
+  // The "*" token is the last token of the pattern
+  add_subscribers(walk, star);
+
+  for (auto &child : star->children)
+    walk_after_segment(walk, child.first, child.second, index);
+  if (star->star != NULL)
+    walk_after_segment(walk, "*", star->star, index);
+
+  struct trie_node *plus = star->plus;
+  if (plus == NULL)
+    return;
+
+  // The "+" after "*" is the last token of the pattern
+  add_subscribers(walk, plus);
+
+  for (auto &child : plus->children)
+    walk_after_segment(walk, child.first, child.second, index);
+  if (plus->plus != NULL)
+    walk_after_segment(walk, "+", plus->plus, index);
+  if (plus->star != NULL)
+    walk_after_segment(walk, "*", plus->star, index);
+}
+
+// Walks the patterns below node, the segments of the topic before index
+// being already matched
+static void walk_node(struct trie_walk *walk, struct trie_node *node, size_t index)
+{
+  const struct topic_tokens *tokens = walk->tokens;
+
+  // The whole topic was matched, the patterns ending here match
+  if (index == tokens->count)
+  {
+    add_subscribers(walk, node);
+    return;
+  }
+
+  auto it = node->children.find(tokens->segments[index]);
+  if (it != node->children.end())
+    walk_node(walk, it->second, index + 1);
+
+  if (node->plus != NULL)
+    walk_node(walk, node->plus, index + 1);
+
+  if (node->star != NULL)
+  {
+    // A literal "*" segment in the topic is matched as a regular segment
+    if (tokens->segments[index] == "*")
+      walk_node(walk, node->star, index + 1);
+    else
+      walk_star(walk, node->star, index);
+  }
+}
+
+void topic_trie_match(struct topic_trie *trie, const struct topic_tokens *topic, vector<int> &subscribers)
+{
+  topic_trie_match(trie, &trie->matcher, topic, subscribers);
+}
+
+void topic_trie_match(const struct topic_trie *trie, struct trie_matcher *matcher, const struct topic_tokens *topic, vector<int> &subscribers)
+{
+  // Start a new deduplication round
+  if (++matcher->epoch == 0)
+  {
+    fill(matcher->seen.begin(), matcher->seen.end(), 0);
+    matcher->epoch = 1;
+  }
+
+  subscribers.clear();
+
+  struct trie_walk walk = {matcher, topic, &subscribers};
+  walk_node(&walk, trie->root, 0);
+}
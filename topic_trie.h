@@ -0,0 +1,71 @@
+// TOPIC_TRIE -- Subscription index over topic segments -- Header file
+#ifndef _TOPIC_TRIE_H
+#define _TOPIC_TRIE_H 1
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "topic_match.h"
+
+struct trie_node
+{
+  // Children for literal segments
+  std::map<std::string, struct trie_node *, std::less<>> children;
+
+  // Children for the "+" and "*" wildcard segments
+  struct trie_node *plus;
+  struct trie_node *star;
+
+  // Parent node and the segment that leads here, used for pruning
+  struct trie_node *parent;
+  std::string segment;
+
+  // Subscribers whose pattern ends in this node
+  std::unordered_set<int> subscribers;
+};
+
+// Deduplication of the subscribers found by one match:
+// seen[subscriber] == epoch if it was already added
+// Each thread that matches concurrently needs its own
+struct trie_matcher
+{
+  std::vector<uint32_t> seen;
+  uint32_t epoch;
+};
+
+struct topic_trie
+{
+  struct trie_node *root;
+
+  // Number of (pattern, subscriber) pairs in the trie
+  size_t subscriptions;
+
+  // Used by the matches that do not bring their own matcher
+  struct trie_matcher matcher;
+};
+
+void topic_trie_init(struct topic_trie *trie);
+void topic_trie_free(struct topic_trie *trie);
+
+void trie_matcher_init(struct trie_matcher *matcher);
+
+// Adds the subscription of subscriber to pattern
+// Returns false if it was already there
+bool topic_trie_subscribe(struct topic_trie *trie, const struct topic_pattern *pattern, int subscriber);
+
+// Removes the subscription of subscriber to pattern
+// Returns false if it was not there
+bool topic_trie_unsubscribe(struct topic_trie *trie, const struct topic_pattern *pattern, int subscriber);
+
+// Stores in subscribers every subscriber with at least one pattern matching
+// topic, each one only once; does not allocate once subscribers has grown
+void topic_trie_match(struct topic_trie *trie, const struct topic_tokens *topic, std::vector<int> &subscribers);
+
+// Same, with the deduplication state of the calling thread; the trie is only
+// read, so several threads can match at the same time
+void topic_trie_match(const struct topic_trie *trie, struct trie_matcher *matcher, const struct topic_tokens *topic, std::vector<int> &subscribers);
+
+#endif
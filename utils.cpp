@@ -6,7 +6,7 @@
 #include <stdio.h>
 
 // Receives len bytes from the socket sockfd and stores them in the buffer
-// Blocks until all bytes are received
+// Blocks until all bytes are received or the connection is closed
 int recv_all(int sockfd, void *buffer, size_t len)
 {
   size_t bytes_received = 0;
@@ -22,6 +22,10 @@ int recv_all(int sockfd, void *buffer, size_t len)
       return -1;
     }
 
+    // The connection was closed before len bytes were received
+    if (bytes == 0)
+      break;
+
     bytes_received += bytes;
     bytes_remaining -= bytes;
     buff += bytes;